@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs the benchmarks built next to this script by its Makefile,
+# collectives for every number of ranks from 2 up to $1 (default 8),
+# printing JSON lines.
+# Usage: bench.sh [max_ranks] [mimpirun]
+
+MAX=${1:-8}
+MIMPIRUN=${2:-./mimpirun}
+DIR=$(dirname "$0")
+
+"$MIMPIRUN" 2 "$DIR/bench_p2p" || exit 1
+"$MIMPIRUN" 2 "$DIR/bench_tags" || exit 1
+
+for ((ranks = 2; ranks <= MAX; ranks++)); do
+	"$MIMPIRUN" "$ranks" "$DIR/bench_collectives" || exit 1
+done
@@ -0,0 +1,98 @@
+/**
+ * Collective benchmark, run under mimpirun with any number of ranks.
+ * Measures MIMPI_Barrier, and MIMPI_Bcast and MIMPI_Reduce for payloads
+ * from 8 B up to 4 MiB. Rank 0 prints one JSON object per line, with the
+ * slowest time among all ranks per call.
+ * */
+
+#include "mimpi.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_SIZE (4 * 1024 * 1024)
+
+double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+void check(MIMPI_Retcode retcode) {
+	if (retcode != MIMPI_SUCCESS) {
+		fprintf(stderr, "MIMPI call failed with %d\n", retcode);
+		exit(1);
+	}
+}
+
+int iterations_for(size_t size) {
+	size_t iterations = (64 * 1024 * 1024) / (size + 4096);
+	if (iterations < 4) iterations = 4;
+	if (iterations > 2000) iterations = 2000;
+
+	return iterations;
+}
+
+/* Slowest time of all ranks, reduced as microseconds. */
+uint64_t slowest(double seconds) {
+	uint8_t mine[8], result[8];
+	uint64_t micros = seconds * 1e6;
+
+	/* Big endian, so that byte-wise MIMPI_MAX compares numbers. */
+	for (int i = 0; i < 8; i++) mine[i] = micros >> (56 - 8 * i);
+	check(MIMPI_Reduce(mine, result, 8, MIMPI_MAX, 0));
+
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) value = value << 8 | result[i];
+
+	return value;
+}
+
+void report(char const *name, size_t bytes, int iterations, double elapsed) {
+	uint64_t micros = slowest(elapsed);
+
+	if (MIMPI_World_rank() == 0)
+		printf("{\"benchmark\": \"%s\", \"ranks\": %d, \"bytes\": %zu, "
+			"\"iterations\": %d, \"call_us\": %.3f}\n", name,
+			MIMPI_World_size(), bytes, iterations,
+			(double)micros / iterations);
+}
+
+int main(void) {
+	MIMPI_Init(false);
+
+	uint8_t *send = malloc(MAX_SIZE), *recv = malloc(MAX_SIZE);
+	if (!send || !recv) return 1;
+	memset(send, 1, MAX_SIZE);
+
+	int iterations = iterations_for(0);
+	check(MIMPI_Barrier());
+	double begin = now();
+	for (int i = 0; i < iterations; i++) check(MIMPI_Barrier());
+	report("barrier", 0, iterations, now() - begin);
+
+	for (size_t bytes = 8; bytes <= MAX_SIZE; bytes *= 8) {
+		iterations = iterations_for(bytes);
+
+		check(MIMPI_Barrier());
+		begin = now();
+		for (int i = 0; i < iterations; i++)
+			check(MIMPI_Bcast(send, bytes, 0));
+		report("bcast", bytes, iterations, now() - begin);
+
+		check(MIMPI_Barrier());
+		begin = now();
+		for (int i = 0; i < iterations; i++)
+			check(MIMPI_Reduce(send, recv, bytes, MIMPI_SUM, 0));
+		report("reduce", bytes, iterations, now() - begin);
+	}
+
+	free(recv);
+	free(send);
+	MIMPI_Finalize();
+
+	return 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * Point-to-point benchmark, run under mimpirun with at least two ranks.
+ * Ranks 0 and 1 measure ping-pong latency, with blocking calls, with
+ * nonblocking requests and with persistent ones, and streaming bandwidth
+ * for message sizes from 0 B up to 64 MiB, other ranks only join the
+ * barriers.
+ * Rank 0 prints one JSON object per line and size.
+ * */
+
+#include "mimpi.h"
+#include "mimpi_ext.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_SIZE (64 * 1024 * 1024)
+#define WINDOW 64
+#define PING_TAG 1
+#define STREAM_TAG 2
+#define ACK_TAG 3
+
+double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+/* Fewer iterations for larger messages, so that every size takes similar time. */
+int iterations_for(size_t size) {
+	size_t iterations = (256 * 1024 * 1024) / (size + 4096);
+	if (iterations < 4) iterations = 4;
+	if (iterations > 10000) iterations = 10000;
+
+	return iterations;
+}
+
+void check(MIMPI_Retcode retcode) {
+	if (retcode != MIMPI_SUCCESS) {
+		fprintf(stderr, "MIMPI call failed with %d\n", retcode);
+		exit(1);
+	}
+}
+
+double pingpong(int rank, char *buffer, size_t size, int iterations) {
+	int peer = rank ^ 1;
+
+	double begin = now();
+
+	for (int i = 0; i < iterations; i++) {
+		if (rank == 0) {
+			check(MIMPI_Send(buffer, size, peer, PING_TAG));
+			check(MIMPI_Recv(buffer, size, peer, PING_TAG));
+		} else {
+			check(MIMPI_Recv(buffer, size, peer, PING_TAG));
+			check(MIMPI_Send(buffer, size, peer, PING_TAG));
+		}
+	}
+
+	return (now() - begin) / iterations / 2;
+}
+
+/* Same exchange with a new nonblocking request for every message. */
+double pingpong_nonblocking(int rank, char *buffer, size_t size,
+	int iterations) {
+	int peer = rank ^ 1;
+	MIMPI_Request request;
+
+	double begin = now();
+
+	for (int i = 0; i < iterations; i++) {
+		for (int turn = 0; turn < 2; turn++) {
+			if ((rank == 0) == (turn == 0))
+				check(MIMPI_Isend(buffer, size, peer, PING_TAG, &request));
+			else
+				check(MIMPI_Irecv(buffer, size, peer, PING_TAG, &request));
+
+			check(MIMPI_Wait(&request));
+		}
+	}
+
+	return (now() - begin) / iterations / 2;
+}
+
+/* Same exchange with requests set up once and started for every message. */
+double pingpong_persistent(int rank, char *buffer, size_t size,
+	int iterations) {
+	int peer = rank ^ 1;
+	MIMPI_Request send;
+	MIMPI_Request recv;
+
+	check(MIMPI_Send_Init(buffer, size, peer, PING_TAG, &send));
+	check(MIMPI_Recv_Init(buffer, size, peer, PING_TAG, &recv));
+
+	double begin = now();
+
+	for (int i = 0; i < iterations; i++) {
+		MIMPI_Request *first = rank == 0 ? &send : &recv;
+		MIMPI_Request *second = rank == 0 ? &recv : &send;
+
+		check(MIMPI_Start(first));
+		check(MIMPI_Wait(first));
+		check(MIMPI_Start(second));
+		check(MIMPI_Wait(second));
+	}
+
+	double elapsed = now() - begin;
+
+	check(MIMPI_Request_Free(&send));
+	check(MIMPI_Request_Free(&recv));
+
+	return elapsed / iterations / 2;
+}
+
+/* Rank 0 streams windows of messages, each acknowledged by rank 1. */
+double stream(int rank, char *buffer, size_t size, int iterations) {
+	int peer = rank ^ 1;
+	char ack = 0;
+
+	double begin = now();
+
+	for (int i = 0; i < iterations; i += WINDOW) {
+		int count = iterations - i < WINDOW ? iterations - i : WINDOW;
+
+		for (int j = 0; j < count; j++) {
+			if (rank == 0) check(MIMPI_Send(buffer, size, peer, STREAM_TAG));
+			else check(MIMPI_Recv(buffer, size, peer, STREAM_TAG));
+		}
+
+		if (rank == 0) check(MIMPI_Recv(&ack, 1, peer, ACK_TAG));
+		else check(MIMPI_Send(&ack, 1, peer, ACK_TAG));
+	}
+
+	return now() - begin;
+}
+
+int main(void) {
+	MIMPI_Init(false);
+
+	int rank = MIMPI_World_rank();
+	int size = MIMPI_World_size();
+
+	if (size < 2) {
+		if (rank == 0) fprintf(stderr, "bench_p2p needs at least 2 ranks\n");
+		MIMPI_Finalize();
+		return 1;
+	}
+
+	char *buffer = malloc(MAX_SIZE);
+	if (!buffer) return 1;
+	memset(buffer, 1, MAX_SIZE);
+
+	for (size_t bytes = 0; bytes <= MAX_SIZE; bytes = bytes ? bytes * 2 : 1) {
+		int iterations = iterations_for(bytes);
+
+		check(MIMPI_Barrier());
+		if (rank >= 2) continue;
+
+		double latency = pingpong(rank, buffer, bytes, iterations);
+		double nonblocking = pingpong_nonblocking(rank, buffer, bytes,
+			iterations);
+		double persistent = pingpong_persistent(rank, buffer, bytes,
+			iterations);
+		double elapsed = stream(rank, buffer, bytes, iterations);
+
+		if (rank == 0)
+			printf("{\"benchmark\": \"p2p\", \"bytes\": %zu, "
+				"\"iterations\": %d, \"latency_us\": %.3f, "
+				"\"nonblocking_latency_us\": %.3f, "
+				"\"persistent_latency_us\": %.3f, "
+				"\"bandwidth_mbps\": %.3f}\n", bytes, iterations,
+				latency * 1e6, nonblocking * 1e6, persistent * 1e6,
+				bytes * (double)iterations / elapsed / 1e6);
+	}
+
+	free(buffer);
+	MIMPI_Finalize();
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * Unexpected-queue stress, run under mimpirun with at least two ranks.
+ * Rank 1 sends a burst of messages with distinct tags, which rank 0 only
+ * starts receiving once they are all queued, newest first, so that every
+ * receive has to find its match among all the others.
+ * Rank 0 prints one JSON object per line and burst length.
+ * */
+
+#include "mimpi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MAX_MESSAGES 65536
+#define MESSAGE_SIZE 16
+
+double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+void check(MIMPI_Retcode retcode) {
+	if (retcode != MIMPI_SUCCESS) {
+		fprintf(stderr, "MIMPI call failed with %d\n", retcode);
+		exit(1);
+	}
+}
+
+int main(void) {
+	MIMPI_Init(false);
+
+	int rank = MIMPI_World_rank();
+	int size = MIMPI_World_size();
+	char buffer[MESSAGE_SIZE] = {0};
+
+	if (size < 2) {
+		if (rank == 0) fprintf(stderr, "bench_tags needs at least 2 ranks\n");
+		MIMPI_Finalize();
+		return 1;
+	}
+
+	for (int messages = 16; messages <= MAX_MESSAGES; messages *= 4) {
+		check(MIMPI_Barrier());
+
+		if (rank == 1)
+			for (int tag = 1; tag <= messages; tag++)
+				check(MIMPI_Send(buffer, MESSAGE_SIZE, 0, tag));
+
+		/* Rank 1 joins only once all its messages have been sent. */
+		check(MIMPI_Barrier());
+
+		if (rank != 0) continue;
+
+		double begin = now();
+		for (int tag = messages; tag >= 1; tag--)
+			check(MIMPI_Recv(buffer, MESSAGE_SIZE, 1, tag));
+		double elapsed = now() - begin;
+
+		printf("{\"benchmark\": \"tags\", \"messages\": %d, "
+			"\"recv_us\": %.3f}\n", messages, elapsed / messages * 1e6);
+	}
+
+	MIMPI_Finalize();
+
+	return 0;
+}
@@ -2,10 +2,14 @@
  * This file is for implementation of MIMPI library.
  * */
 
+#define _GNU_SOURCE
+
 #include "channel.h"
 #include "mimpi.h"
 #include "mimpi_common.h"
+#include "mimpi_ext.h"
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -13,63 +17,355 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /*** Constant definitions ****************************************************/
 
-#define MIMPI_PACKET_SIZE 512
-#define MIMPI_PREFIX_SIZE ((MIMPI_PACKET_SIZE) - sizeof(header_t))
+#define MIMPI_VECTOR_SIZE 8
+#define MIMPI_READ_AHEAD (16 * 1024)
+#define MIMPI_BATCH_DELAY (50 * 1000)
+#define MIMPI_DEADLOCK_TIMEOUT (1000 * 1000)
+#define MIMPI_SPIN_CHECK 64
 
+#define MIMPI_WORLD_CONTEXT 0
 #define MIMPI_GROUP_TAG -1
 #define MIMPI_CLOSE_TAG -2
-#define MIMPI_REQUEST_TAG -3
+#define MIMPI_PROBE_TAG -3
+#define MIMPI_RENDEZVOUS_TAG -4
+#define MIMPI_CLEAR_TAG -5
+#define MIMPI_PAYLOAD_TAG -6
+#define MIMPI_DEADLOCK_TAG -7
+
+#define MIMPI_MAX_ARITY 16
+/* Enough for a binomial tree over any positive int number of ranks. */
+#define MIMPI_CHILDREN 31
+#define MIMPI_TOPOLOGY_THRESHOLD (64 * 1024)
+#define MIMPI_SEGMENT_SIZE (64 * 1024)
+#define MIMPI_ALLREDUCE_RING_THRESHOLD (64 * 1024)
+
+#define MIMPI_RING_TIMEOUT_NS (10 * 1000 * 1000)
+#define MIMPI_ENGINE_EVENTS 64
+
+#define MIMPI_POOL_MIN_SHIFT 6
+#define MIMPI_POOL_CLASSES 11
+#define MIMPI_POOL_DEPTH 32
+
+#define MIMPI_INDEX_BUCKETS 128
+#define MIMPI_INDEX_KEY 0
+#define MIMPI_INDEX_SIZE 1
+
+#define MIMPI_RENDEZVOUS_THRESHOLD SIZE_MAX
+
+#define MIMPI_PROFILE_BUCKETS 40
+#define MIMPI_TRACE_EVENTS 1024
+
+#define MIMPI_MAX_NODES 1024
 
-#define MIMPI_NOOP MIMPI_MAX
-#define MIMPI_CHILDREN 2
+#define MIMPI_TCP_TIMEOUT (60l * 1000 * 1000 * 1000)
+#define MIMPI_TCP_RETRY (10 * 1000 * 1000)
 
 /*** Structures **************************************************************/
 
+/*
+    On the wire every header is followed by exactly header.size bytes.
+    Context tells apart the communicators user tags and collectives are in.
+*/
 typedef struct {
 	size_t size;
 	int tag;
+	int context;
 } header_t;
 
+
+/* Announces, clears and carries a payload left at the sender. */
 typedef struct {
 	header_t header;
-	char data[MIMPI_PACKET_SIZE - sizeof(header_t)];
-} prefix_t;
+	unsigned long handle;
+} rendezvous_t;
 
-struct Outbox_Message {
-	struct Outbox_Message *next;
-	int tag;
-	size_t size;
+/* Tells a peer we wait for it, and which of its waits we know about. */
+typedef struct {
+	unsigned long wait;
+	unsigned long ack;
+} probe_t;
+
+/*
+    First message on a TCP channel, open is false if it is refused by a
+    rank that finished after joining that many collectives.
+*/
+typedef struct {
+	int rank;
+	int open;
+	unsigned long collectives;
+} hello_t;
+
+/*
+    Wire layer of the channels to a peer. The writer is opened on first
+    use, or the channel refused in MIMPI_Finalize if it never was.
+*/
+struct Transport {
+	int (*open)(int destination);
+	void (*refuse)(int destination);
+	ssize_t (*sendv)(int destination, struct iovec *vector, int count);
+	ssize_t (*recv)(int source, void *buffer, size_t count);
+	bool (*buffered)(int source);
 };
 
-struct Outbox {
-	struct Outbox_Message *top;
+/* Bytes read ahead from the stream of a channel, served from begin to end. */
+struct Channel_Buffer {
+	size_t begin;
+	size_t end;
+	char data[MIMPI_READ_AHEAD];
 };
 
 typedef enum {
 	INBOX_MESSAGE,
-	INBOX_REQUEST,
-	INBOX_CLOSE,
-	INBOX_GUARD,
-	INBOX_DEADLOCK
+	INBOX_PENDING,
+	INBOX_RENDEZVOUS
 } Inbox_Message_Type;
 
+typedef enum {
+	INBOX_MISSED,
+	INBOX_MATCHED,
+	INBOX_CLEARED
+} Inbox_Match_Result;
+
+struct Inbox_Post {
+	struct Inbox_Post *next;
+	int tag;
+	int context;
+	size_t size;
+	void *data;
+	MIMPI_Retcode retcode;
+	_Atomic bool delivered;
+	size_t buckets[2];
+	bool indexed;
+};
+
+struct Inbox_Link {
+	struct Inbox_Message *previous;
+	struct Inbox_Message *next;
+};
+
+/*
+    Messages not yet received live in the index, chained by (tag, context,
+    size) and by size alone. Cleared rendezvous messages are chained by next.
+*/
 struct Inbox_Message {
 	Inbox_Message_Type type;
 	struct Inbox_Message *next;
-	sem_t available;
 	int tag;
+	int context;
 	size_t size;
 	void *data;
+	int pool;
+	struct Inbox_Post *post;
+	unsigned long sequence;
+	unsigned long handle;
+	struct Inbox_Link links[2];
 };
 
-struct Inbox {
-	int rank;
+struct Inbox_Queue {
 	struct Inbox_Message *front;
 	struct Inbox_Message *back;
-	size_t deadlocks;
+};
+
+/* Recycled payload buffer, linked through its own first bytes. */
+struct Inbox_Buffer {
+	struct Inbox_Buffer *next;
+};
+
+/*
+    Blocked receive of the owner as seen by deadlock detection: its unique
+    id, the latest probe of the peer seen and whether the timeout expired.
+*/
+struct Inbox_Detection {
+	unsigned long wait;
+	unsigned long probe;
+	unsigned long ack;
+	struct timespec deadline;
+	bool expired;
+};
+
+struct Inbox {
+	int rank;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int waiters;
+	struct Inbox_Post *posted;
+	struct Inbox_Message *cleared;
+	struct Inbox_Queue index[2][MIMPI_INDEX_BUCKETS];
+	unsigned long sequence;
+	unsigned long waits;
+	unsigned long probe;
+	unsigned long probe_ack;
+	unsigned long deadlock;
+	unsigned long collectives;
+	bool closed;
+	struct Inbox_Message *free_messages;
+	struct Inbox_Buffer *free_buffers[MIMPI_POOL_CLASSES];
+	size_t free_counts[MIMPI_POOL_CLASSES];
+	MIMPI_Pool_Stats stats;
+	size_t depth;
+	size_t max_depth;
+};
+
+typedef enum {
+	PROFILE_SEND,
+	PROFILE_RECV,
+	PROFILE_BARRIER,
+	PROFILE_BCAST,
+	PROFILE_REDUCE,
+	PROFILE_ALLREDUCE,
+	PROFILE_REDUCE_SCATTER,
+	PROFILE_GATHER,
+	PROFILE_SCATTER,
+	PROFILE_ALLGATHER,
+	PROFILE_ALLTOALL,
+	PROFILE_WRITE,
+	PROFILE_CALLS
+} Profile_Call;
+
+/* Bucket i counts calls that took from 2^(i-1) up to 2^i nanoseconds. */
+struct Profile_Histogram {
+	unsigned long count;
+	unsigned long bytes;
+	unsigned long nanoseconds;
+	unsigned long buckets[MIMPI_PROFILE_BUCKETS];
+};
+
+struct Profile_Peer {
+	unsigned long sent_messages;
+	unsigned long sent_bytes;
+	unsigned long received_messages;
+	unsigned long received_bytes;
+};
+
+/* Counters of a single thread, only ever written by it. */
+struct Profile {
+	struct Profile *next;
+	struct Profile_Histogram calls[PROFILE_CALLS];
+	struct Profile_Peer peers[];
+};
+
+typedef enum {
+	TRACE_CALL,
+	TRACE_SENT,
+	TRACE_RECEIVED
+} Trace_Kind;
+
+/* Peer, tag and sequence number only describe sent and received messages. */
+struct Trace_Event {
+	Trace_Kind kind;
+	char const *name;
+	long begin;
+	long end;
+	int peer;
+	int tag;
+	size_t bytes;
+	unsigned long sequence;
+};
+
+/* Events of a single thread, only ever written by it. */
+struct Trace {
+	struct Trace *next;
+	int thread;
+	char name[32];
+	size_t count;
+	size_t capacity;
+	struct Trace_Event *events;
+};
+
+typedef enum {
+	REQUEST_SEND,
+	REQUEST_RECV,
+	REQUEST_CLEAR
+} Request_Type;
+
+struct MIMPI_Request_Data {
+	Request_Type type;
+	struct MIMPI_Request_Data *next;
+	int peer;
+	int tag;
+	int context;
+	size_t size;
+	void const *data;
+	struct iovec const *vector;
+	int vectors;
+	struct iovec single;
+	header_t header;
+	struct iovec wire[2];
+	int wires;
+	struct Inbox_Post post;
+	MIMPI_Retcode retcode;
+	unsigned long handle;
+	bool rendezvous;
+	bool announced;
+	bool complete;
+	bool persistent;
+	bool active;
+};
+
+struct Sender {
+	int rank;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct MIMPI_Request_Data *front;
+	struct MIMPI_Request_Data *back;
+	struct MIMPI_Request_Data *announced;
+	unsigned long handles;
+	char *batch;
+	size_t batched;
+	long batch_since;
+	MIMPI_Retcode batch_retcode;
+	bool batch_listed;
+	bool running;
+	bool busy;
+	bool closing;
+	bool failed;
+};
+
+/* Ranks of a communicator are indices into ranks, which maps them to world. */
+struct MIMPI_Comm_Data {
+	int context;
+	int rank;
+	int size;
+	int *ranks;
+};
+
+typedef enum {
+	TOPOLOGY_KARY,
+	TOPOLOGY_BINOMIAL,
+	TOPOLOGY_CHAIN
+} Topology_Shape;
+
+struct Topology {
+	Topology_Shape shape;
+	int arity;
 };
 
 /*** Global variables ********************************************************/
@@ -77,7 +373,49 @@ struct Inbox {
 static bool MIMPI_deadlock_detection = false;
 static pthread_t* MIMPI_receivers = NULL;
 static struct Inbox* MIMPI_inboxes = NULL;
-static struct Outbox* MIMPI_outboxes = NULL;
+static struct Sender* MIMPI_senders = NULL;
+static int* MIMPI_readers = NULL;
+static int* MIMPI_writers = NULL;
+static struct MIMPI_Ring** MIMPI_in_rings = NULL;
+static struct MIMPI_Ring** MIMPI_out_rings = NULL;
+static struct Channel_Buffer** MIMPI_read_buffers = NULL;
+static pthread_t MIMPI_progress;
+static bool MIMPI_progress_engine = false;
+static void *MIMPI_shm = NULL;
+static size_t MIMPI_shm_size = 0;
+static size_t MIMPI_ring_capacity = 0;
+static unsigned long MIMPI_collectives = 0;
+static struct Topology MIMPI_small_topology = { TOPOLOGY_KARY, 2 };
+static struct Topology MIMPI_large_topology = { TOPOLOGY_KARY, 2 };
+static struct Topology const MIMPI_binomial_topology = { TOPOLOGY_BINOMIAL, 0 };
+static size_t MIMPI_topology_threshold = MIMPI_TOPOLOGY_THRESHOLD;
+static size_t MIMPI_rendezvous_threshold = MIMPI_RENDEZVOUS_THRESHOLD;
+static size_t MIMPI_batch_size = 0;
+static long MIMPI_batch_delay = MIMPI_BATCH_DELAY;
+static int* MIMPI_batched = NULL;
+static int MIMPI_batched_count = 0;
+static long MIMPI_deadlock_timeout = MIMPI_DEADLOCK_TIMEOUT;
+static long MIMPI_spin_timeout = 0;
+static _Atomic unsigned int MIMPI_arrivals = 0;
+static _Atomic int MIMPI_arrival_waiters = 0;
+static int MIMPI_any_next = 0;
+static char *MIMPI_profile_path = NULL;
+static struct Profile *_Atomic MIMPI_profiles = NULL;
+static _Thread_local struct Profile *MIMPI_profile = NULL;
+static char *MIMPI_trace_path = NULL;
+static struct Trace *_Atomic MIMPI_traces = NULL;
+static _Thread_local struct Trace *MIMPI_trace = NULL;
+static _Atomic int MIMPI_trace_threads = 0;
+static unsigned long *MIMPI_trace_sent = NULL;
+static unsigned long *MIMPI_trace_received = NULL;
+static int *MIMPI_nodes = NULL;
+static cpu_set_t MIMPI_helper_cpus;
+static struct Transport const **MIMPI_transports = NULL;
+static char **MIMPI_hosts = NULL;
+static int MIMPI_tcp_port = 0;
+static int MIMPI_tcp_listener = -1;
+static struct MIMPI_Comm_Data MIMPI_world = { MIMPI_WORLD_CONTEXT };
+static int MIMPI_next_context = MIMPI_WORLD_CONTEXT + 1;
 
 /*** Utilities ***************************************************************/
 
@@ -90,12 +428,33 @@ bool _MIMPI_Match(
 	if (expected_size != size)
 		return false;
 
-	if (expected_tag == 0 || tag == 0)
-		return true;
+	/* Wildcards never match internal traffic, which uses negative tags. */
+	if (expected_tag == MIMPI_ANY_TAG)
+		return tag >= 0;
+
+	if (tag == MIMPI_ANY_TAG)
+		return expected_tag >= 0;
 
 	return expected_tag == tag;
 }
 
+long _MIMPI_Clock(void) {
+	struct timespec now;
+	ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &now));
+
+	return now.tv_sec * 1000000000l + now.tv_nsec;
+}
+
+size_t _MIMPI_Vector_Size(
+	struct iovec const *vector,
+	int count
+) {
+	size_t size = 0;
+	for (int i = 0; i < count; i++) size += vector[i].iov_len;
+
+	return size;
+}
+
 int readenv(int *result, const char *name) {
 	char *number = getenv(name);
 
@@ -113,55 +472,177 @@ int readenv(int *result, const char *name) {
 	return 0;
 }
 
-void _MIMPI_Reduce(
-	uint8_t *result,
-	const uint8_t *other,
-	size_t size,
-	MIMPI_Op op
+/*** Polling *****************************************************************/
+
+/*
+    MIMPI_SPIN_TIMEOUT makes a thread about to sleep for a message poll for
+    it for up to that many nanoseconds first. This spares the context
+    switches of the handoff when ranks have cores of their own, and burns
+    CPU time otherwise, so it is off by default.
+*/
+void _Spin_Init(void) {
+	char *timeout = getenv("MIMPI_SPIN_TIMEOUT");
+	if (timeout) MIMPI_spin_timeout = strtol(timeout, NULL, 10);
+}
+
+/* Deadline of polling that starts now, or zero when polling is off. */
+long _Spin_Begin(void) {
+	return MIMPI_spin_timeout ? _MIMPI_Clock() + MIMPI_spin_timeout : 0;
+}
+
+/* Pauses between two polls, returns false once the deadline passed. */
+bool _Spin_Continue(
+	long deadline,
+	unsigned long *spins
 ) {
-	for (size_t i = 0; i < size; i++) {
-		switch (op) {
-			case MIMPI_MAX:
-				if (other[i] > result[i]) result[i] = other[i];
-				break;
+	if (!deadline) return false;
 
-			case MIMPI_MIN:
-				if (other[i] < result[i]) result[i] = other[i];
-				break;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
 
-			case MIMPI_SUM:
-				result[i] += other[i];
-				break;
+	return ++*spins % MIMPI_SPIN_CHECK || _MIMPI_Clock() < deadline;
+}
 
-			case MIMPI_PROD:
-				result[i] *= other[i];
-				break;
-		}
+/* Polls until fd becomes readable or the deadline of polling passes. */
+void _Spin_Readable(
+	int fd
+) {
+	long deadline = _Spin_Begin();
+	unsigned long spins = 0;
+	struct pollfd reader = { .fd = fd, .events = POLLIN };
+
+	while (deadline && poll(&reader, 1, 0) == 0 &&
+		_Spin_Continue(deadline, &spins));
+}
+
+/*** Topologies **************************************************************/
+
+bool _Topology_Parse(
+	struct Topology *topology,
+	const char *spec
+) {
+	if (strcmp(spec, "binary") == 0) {
+		*topology = (struct Topology){ TOPOLOGY_KARY, 2 };
+		return true;
+	}
+
+	if (strcmp(spec, "binomial") == 0) {
+		*topology = (struct Topology){ TOPOLOGY_BINOMIAL, 0 };
+		return true;
+	}
+
+	if (strcmp(spec, "chain") == 0) {
+		*topology = (struct Topology){ TOPOLOGY_CHAIN, 1 };
+		return true;
+	}
+
+	if (strncmp(spec, "kary:", 5) == 0) {
+		char *end;
+		long arity = strtol(spec + 5, &end, 10);
+
+		if (*end || arity < 1 || arity > MIMPI_MAX_ARITY)
+			return false;
+
+		*topology = (struct Topology){ TOPOLOGY_KARY, arity };
+		return true;
 	}
+
+	return false;
+}
+
+void _Topology_Read(
+	struct Topology *topology,
+	const char *name
+) {
+	char *spec = getenv(name);
+
+	if (spec && !_Topology_Parse(topology, spec))
+		fatal("Invalid %s=%s, expected binary, kary:K, binomial or chain",
+			name, spec);
+}
+
+/*
+    MIMPI_TOPOLOGY selects the tree shape of all collectives,
+    MIMPI_TOPOLOGY_SMALL and MIMPI_TOPOLOGY_LARGE override it for payloads
+    below and from MIMPI_TOPOLOGY_THRESHOLD bytes up.
+*/
+void _Topology_Init(void) {
+	_Topology_Read(&MIMPI_small_topology, "MIMPI_TOPOLOGY");
+	MIMPI_large_topology = MIMPI_small_topology;
+
+	_Topology_Read(&MIMPI_small_topology, "MIMPI_TOPOLOGY_SMALL");
+	_Topology_Read(&MIMPI_large_topology, "MIMPI_TOPOLOGY_LARGE");
+
+	char *threshold = getenv("MIMPI_TOPOLOGY_THRESHOLD");
+	if (threshold) MIMPI_topology_threshold = strtoull(threshold, NULL, 10);
+}
+
+struct Topology const *_Topology_For(
+	size_t count
+) {
+	return count < MIMPI_topology_threshold ?
+		&MIMPI_small_topology : &MIMPI_large_topology;
 }
 
+/* Neighbours in a tree over ranks renumbered so that root becomes zero. */
 void _MIMPI_Get_Neighbours(
+	struct Topology const *topology,
 	int *parent,
 	int *children,
 	int rank,
 	int root,
 	int size
 ) {
-	int index = (size + rank - root) % size + 1;
-
-	if (index == 1) *parent = -1;
-	else *parent = (index / MIMPI_CHILDREN + root - 1) % size;
-
-	for (int i = 0; i < MIMPI_CHILDREN; i++) {
-		int child = index * MIMPI_CHILDREN + i;
-
-		if (child > size) {
-			children[i] = -1;
-			continue;
+	int index = rank >= root ? rank - root : rank + (size - root);
+	int parent_index = -1;
+	int count = 0;
+
+	for (int i = 0; i < MIMPI_CHILDREN; i++) children[i] = -1;
+
+	switch (topology->shape) {
+		case TOPOLOGY_KARY:
+			if (index) parent_index = (index - 1) / topology->arity;
+
+			for (int i = 0; i < topology->arity; i++) {
+				long long child = (long long)index * topology->arity + 1 + i;
+				if (child < size) children[count++] = child;
+			}
+			break;
+
+		case TOPOLOGY_BINOMIAL: {
+			/* Root has no lowest set bit and so no bound on its subtrees. */
+			int lowest = index & -index;
+			if (index) parent_index = index - lowest;
+
+			/* Largest subtrees first, they take the longest to finish. */
+			int step = 1;
+			while ((!index || step < lowest / 2) &&
+				step <= (size - 1 - index) / 2)
+				step *= 2;
+
+			for (; step >= 1 && count < MIMPI_CHILDREN; step /= 2)
+				if ((!index || step < lowest) && step < size - index)
+					children[count++] = index + step;
+			break;
 		}
 
-		children[i] = (child + root - 1) % size;
+		case TOPOLOGY_CHAIN:
+			if (index) parent_index = index - 1;
+			if (index + 1 < size) children[count++] = index + 1;
+			break;
 	}
+
+	/* Renumbering back avoids overflowing int on huge jobs. */
+	if (parent_index == -1) *parent = -1;
+	else if (parent_index >= size - root) *parent = parent_index - (size - root);
+	else *parent = parent_index + root;
+
+	for (int i = 0; i < count; i++)
+		children[i] = children[i] >= size - root ?
+			children[i] - (size - root) : children[i] + root;
 }
 
 MIMPI_Retcode _MIMPI_Update_Retcode(
@@ -191,669 +672,4870 @@ MIMPI_Retcode _MIMPI_Update_Retcode(
 	return MIMPI_SUCCESS;
 }
 
-/*** Outbox ******************************************************************/
-
-void Outbox_Init(
-	struct Outbox *outbox
-) {
-	outbox->top = NULL;
-}
-
-void Outbox_Destroy(
-	struct Outbox *outbox
-) {
-	struct Outbox_Message *message = outbox->top;
+/*** Reduction kernels *******************************************************/
 
-	while (message) {
-		struct Outbox_Message *freeable = message;
+typedef void (*reduce_kernel_t)(void *, void const *, size_t);
 
-		message = message->next;
+/* Both operands are named a (accumulated) and b (incoming) in expressions. */
+#define MIMPI_KERNEL(name, type, expression)                                  \
+	static void name(void *raw_result, void const *raw_other, size_t count) { \
+		type *restrict result = (type*)raw_result;                            \
+		type const *restrict other = (type const*)raw_other;                  \
+                                                                              \
+		for (size_t i = 0; i < count; i++) {                                  \
+			type a = result[i], b = other[i];                                 \
+			result[i] = (expression);                                         \
+		}                                                                     \
+	}
 
-		free(freeable);
+/* Same, with a vector loop running width elements per step ahead of it. */
+#define MIMPI_SIMD_KERNEL(name, type, width, load, store, vop, expression)    \
+	static void name(void *raw_result, void const *raw_other, size_t count) { \
+		type *restrict result = (type*)raw_result;                            \
+		type const *restrict other = (type const*)raw_other;                  \
+		size_t i = 0;                                                         \
+                                                                              \
+		for (; i + (width) <= count; i += (width))                            \
+			store(result + i, vop(load(other + i), load(result + i)));        \
+                                                                              \
+		for (; i < count; i++) {                                              \
+			type a = result[i], b = other[i];                                 \
+			result[i] = (expression);                                         \
+		}                                                                     \
 	}
-}
 
-void Outbox_Push(
-	struct Outbox *outbox,
-	int tag,
-	size_t size
-) {
-	struct Outbox_Message *message =
-		(struct Outbox_Message*)malloc(sizeof(struct Outbox_Message));
+#define MIMPI_MAX_EXPRESSION (b > a ? b : a)
+#define MIMPI_MIN_EXPRESSION (b < a ? b : a)
+#define MIMPI_WRAPPING_SUM(type, unsigned_type) ((type)((unsigned_type)a + (unsigned_type)b))
+#define MIMPI_WRAPPING_PROD(type, unsigned_type) ((type)((unsigned_type)a * (unsigned_type)b))
+
+MIMPI_KERNEL(_Kernel_Uint8_Max, uint8_t, MIMPI_MAX_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Uint8_Min, uint8_t, MIMPI_MIN_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Uint8_Sum, uint8_t, (uint8_t)(a + b))
+MIMPI_KERNEL(_Kernel_Uint8_Prod, uint8_t, (uint8_t)(a * b))
+
+MIMPI_KERNEL(_Kernel_Int64_Max, int64_t, MIMPI_MAX_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Int64_Min, int64_t, MIMPI_MIN_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Int64_Sum, int64_t, MIMPI_WRAPPING_SUM(int64_t, uint64_t))
+MIMPI_KERNEL(_Kernel_Int64_Prod, int64_t, MIMPI_WRAPPING_PROD(int64_t, uint64_t))
+
+#if defined(__AVX2__)
+#define MIMPI_I32_LOAD(p) _mm256_loadu_si256((__m256i const*)(p))
+#define MIMPI_I32_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), (v))
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Max, int32_t, 8, MIMPI_I32_LOAD, MIMPI_I32_STORE, _mm256_max_epi32, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Min, int32_t, 8, MIMPI_I32_LOAD, MIMPI_I32_STORE, _mm256_min_epi32, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Sum, int32_t, 8, MIMPI_I32_LOAD, MIMPI_I32_STORE, _mm256_add_epi32, MIMPI_WRAPPING_SUM(int32_t, uint32_t))
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Prod, int32_t, 8, MIMPI_I32_LOAD, MIMPI_I32_STORE, _mm256_mullo_epi32, MIMPI_WRAPPING_PROD(int32_t, uint32_t))
+#elif defined(__ARM_NEON)
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Max, int32_t, 4, vld1q_s32, vst1q_s32, vmaxq_s32, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Min, int32_t, 4, vld1q_s32, vst1q_s32, vminq_s32, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Sum, int32_t, 4, vld1q_s32, vst1q_s32, vaddq_s32, MIMPI_WRAPPING_SUM(int32_t, uint32_t))
+MIMPI_SIMD_KERNEL(_Kernel_Int32_Prod, int32_t, 4, vld1q_s32, vst1q_s32, vmulq_s32, MIMPI_WRAPPING_PROD(int32_t, uint32_t))
+#else
+MIMPI_KERNEL(_Kernel_Int32_Max, int32_t, MIMPI_MAX_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Int32_Min, int32_t, MIMPI_MIN_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Int32_Sum, int32_t, MIMPI_WRAPPING_SUM(int32_t, uint32_t))
+MIMPI_KERNEL(_Kernel_Int32_Prod, int32_t, MIMPI_WRAPPING_PROD(int32_t, uint32_t))
+#endif
+
+#if defined(__AVX__)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Max, float, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_max_ps, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Min, float, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_min_ps, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Sum, float, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Prod, float, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps, a * b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Max, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_max_pd, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Min, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_min_pd, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Sum, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Prod, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, a * b)
+#elif defined(__SSE2__)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Max, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_max_ps, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Min, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_min_ps, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Sum, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Prod, float, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_mul_ps, a * b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Max, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_max_pd, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Min, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_min_pd, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Sum, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Prod, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, a * b)
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Max, float, 4, vld1q_f32, vst1q_f32, vmaxq_f32, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Min, float, 4, vld1q_f32, vst1q_f32, vminq_f32, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Sum, float, 4, vld1q_f32, vst1q_f32, vaddq_f32, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Float_Prod, float, 4, vld1q_f32, vst1q_f32, vmulq_f32, a * b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Max, double, 2, vld1q_f64, vst1q_f64, vmaxq_f64, MIMPI_MAX_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Min, double, 2, vld1q_f64, vst1q_f64, vminq_f64, MIMPI_MIN_EXPRESSION)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Sum, double, 2, vld1q_f64, vst1q_f64, vaddq_f64, a + b)
+MIMPI_SIMD_KERNEL(_Kernel_Double_Prod, double, 2, vld1q_f64, vst1q_f64, vmulq_f64, a * b)
+#else
+MIMPI_KERNEL(_Kernel_Float_Max, float, MIMPI_MAX_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Float_Min, float, MIMPI_MIN_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Float_Sum, float, a + b)
+MIMPI_KERNEL(_Kernel_Float_Prod, float, a * b)
+MIMPI_KERNEL(_Kernel_Double_Max, double, MIMPI_MAX_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Double_Min, double, MIMPI_MIN_EXPRESSION)
+MIMPI_KERNEL(_Kernel_Double_Sum, double, a + b)
+MIMPI_KERNEL(_Kernel_Double_Prod, double, a * b)
+#endif
+
+/* Indexed by MIMPI_Datatype, then by MIMPI_Op. */
+static const reduce_kernel_t MIMPI_kernels[][4] = {
+	[MIMPI_UINT8] = {
+		[MIMPI_MAX] = _Kernel_Uint8_Max, [MIMPI_MIN] = _Kernel_Uint8_Min,
+		[MIMPI_SUM] = _Kernel_Uint8_Sum, [MIMPI_PROD] = _Kernel_Uint8_Prod
+	},
+	[MIMPI_INT32] = {
+		[MIMPI_MAX] = _Kernel_Int32_Max, [MIMPI_MIN] = _Kernel_Int32_Min,
+		[MIMPI_SUM] = _Kernel_Int32_Sum, [MIMPI_PROD] = _Kernel_Int32_Prod
+	},
+	[MIMPI_INT64] = {
+		[MIMPI_MAX] = _Kernel_Int64_Max, [MIMPI_MIN] = _Kernel_Int64_Min,
+		[MIMPI_SUM] = _Kernel_Int64_Sum, [MIMPI_PROD] = _Kernel_Int64_Prod
+	},
+	[MIMPI_FLOAT] = {
+		[MIMPI_MAX] = _Kernel_Float_Max, [MIMPI_MIN] = _Kernel_Float_Min,
+		[MIMPI_SUM] = _Kernel_Float_Sum, [MIMPI_PROD] = _Kernel_Float_Prod
+	},
+	[MIMPI_DOUBLE] = {
+		[MIMPI_MAX] = _Kernel_Double_Max, [MIMPI_MIN] = _Kernel_Double_Min,
+		[MIMPI_SUM] = _Kernel_Double_Sum, [MIMPI_PROD] = _Kernel_Double_Prod
+	}
+};
 
-	message->tag = tag;
-	message->size = size;
+static const size_t MIMPI_type_sizes[] = {
+	[MIMPI_UINT8] = sizeof(uint8_t),
+	[MIMPI_INT32] = sizeof(int32_t),
+	[MIMPI_INT64] = sizeof(int64_t),
+	[MIMPI_FLOAT] = sizeof(float),
+	[MIMPI_DOUBLE] = sizeof(double)
+};
 
-	message->next = outbox->top;
-	outbox->top = message;
+size_t _MIMPI_Type_Size(
+	MIMPI_Datatype type
+) {
+	return MIMPI_type_sizes[type];
 }
 
-bool Outbox_Pop(
-	struct Outbox *outbox,
-	int tag,
-	size_t size
+void _MIMPI_Reduce(
+	void *result,
+	void const *other,
+	size_t count,
+	MIMPI_Datatype type,
+	MIMPI_Op op
 ) {
-	struct Outbox_Message *previous = NULL;
-	struct Outbox_Message *message = outbox->top;
-
-	while (message) {
-		if (!_MIMPI_Match(size, tag, message->size, message->tag)) {
-			previous = message;
-			message = message->next;
-			continue;
-		}
-
-		if (previous) previous->next = message->next;
-		else outbox->top = message->next;
-		free(message);
-
-		return true;
-	}
-
-	return false;
+	if (count) MIMPI_kernels[type][op](result, other, count);
 }
 
-/*** Inbox helpers ***********************************************************/
-
-bool _Inbox_Match(
-	struct Inbox_Message* message,
-	int tag,
-	size_t size
+/* Rejects values outside the enums before they index the tables above. */
+void _MIMPI_Check_Reduction(
+	MIMPI_Datatype type,
+	MIMPI_Op op
 ) {
-	if (message->size != size)
-		return false;
+	size_t types = sizeof(MIMPI_kernels) / sizeof(MIMPI_kernels[0]);
+	size_t ops = sizeof(MIMPI_kernels[0]) / sizeof(MIMPI_kernels[0][0]);
 
-	if (message->tag == MIMPI_ANY_TAG || tag == MIMPI_ANY_TAG)
-		return true;
+	if ((unsigned int)type >= types)
+		fatal("Invalid MIMPI_Datatype %d", (int)type);
 
-	return message->tag == tag;
+	if ((unsigned int)op >= ops)
+		fatal("Invalid MIMPI_Op %d", (int)op);
 }
 
-struct Inbox_Message *_Inbox_New(void) {
-	struct Inbox_Message *result =
-		(struct Inbox_Message*)malloc(sizeof(struct Inbox_Message));
-	ASSERT_NOT_NULL(result);
+/*** Tracing *****************************************************************/
+
+/*
+    MIMPI_TRACE records a timeline, which each rank writes out at
+    MIMPI_Finalize in the Chrome trace format to the file named by its value
+    followed by a dot, the rank and ".json". Every thread appends to its own
+    buffer, linked once into a global list. Messages are numbered per pair
+    of ranks in the order they go on the wire, so the sending and the
+    receiving end of each can be joined by a flow.
+*/
+void _Trace_Init(void) {
+	MIMPI_trace_path = getenv("MIMPI_TRACE");
+
+	if (MIMPI_trace_path) {
+		MIMPI_trace_sent = (unsigned long*)calloc(MIMPI_World_size(),
+			sizeof(unsigned long));
+		MIMPI_trace_received = (unsigned long*)calloc(MIMPI_World_size(),
+			sizeof(unsigned long));
+		ASSERT_NOT_NULL(MIMPI_trace_sent);
+		ASSERT_NOT_NULL(MIMPI_trace_received);
+	}
+}
 
-	result->next = NULL;
-	result->type = INBOX_GUARD;
-	result->tag = 0;
-	result->size = 0;
-	result->data = NULL;
-	ASSERT_SYS_OK(sem_init(&result->available, 0, 0));
+struct Trace *_Trace_Local(void) {
+	if (MIMPI_trace) return MIMPI_trace;
 
-	return result;
-}
+	struct Trace *trace = (struct Trace*)calloc(1, sizeof(struct Trace));
+	ASSERT_NOT_NULL(trace);
 
-void _Inbox_Save(
-	struct Inbox *inbox,
-	Inbox_Message_Type type,
-	int tag,
-	size_t size,
-	void *data
-) {
-	struct Inbox_Message *message = inbox->back;
+	trace->thread = atomic_fetch_add(&MIMPI_trace_threads, 1);
+	snprintf(trace->name, sizeof(trace->name), "main");
 
-	inbox->back = _Inbox_New();
+	trace->next = atomic_load(&MIMPI_traces);
+	while (!atomic_compare_exchange_weak(&MIMPI_traces, &trace->next, trace));
 
-	message->type = type;
-	message->next = inbox->back;
-	message->tag = tag;
-	message->size = size;
-	message->data = data;
-	ASSERT_SYS_OK(sem_post(&message->available));
+	return MIMPI_trace = trace;
 }
 
-struct Inbox_Message *_Inbox_Delete(
-	struct Inbox_Message *message
+/* Names the calling thread in the timeline, peer is -1 if it serves none. */
+void _Trace_Name(
+	char const *role,
+	int peer
 ) {
-	struct Inbox_Message *next = message->next;
+	if (!MIMPI_trace_path) return;
 
-	ASSERT_SYS_OK(sem_destroy(&message->available));
-	if (message->data) free(message->data);
-	free(message);
+	struct Trace *trace = _Trace_Local();
 
-	return next;
+	if (peer < 0) snprintf(trace->name, sizeof(trace->name), "%s", role);
+	else snprintf(trace->name, sizeof(trace->name), "%s %d", role, peer);
 }
 
-/*** Inbox interface *********************************************************/
-
-void Inbox_Init(
-	struct Inbox *inbox,
-	int rank
+void _Trace_Add(
+	Trace_Kind kind,
+	char const *name,
+	long begin,
+	int peer,
+	int tag,
+	size_t bytes,
+	unsigned long sequence
 ) {
-	inbox->rank = rank;
-	inbox->deadlocks = 0;
+	struct Trace *trace = _Trace_Local();
+
+	if (trace->count == trace->capacity) {
+		trace->capacity = trace->capacity ?
+			2 * trace->capacity : MIMPI_TRACE_EVENTS;
+		trace->events = (struct Trace_Event*)realloc(trace->events,
+			trace->capacity * sizeof(struct Trace_Event));
+		ASSERT_NOT_NULL(trace->events);
+	}
 
-	inbox->front = _Inbox_New();
-	ASSERT_SYS_OK(sem_post(&inbox->front->available));
+	trace->events[trace->count++] = (struct Trace_Event){
+		kind, name, begin, _MIMPI_Clock(), peer, tag, bytes, sequence
+	};
+}
 
-	inbox->back = _Inbox_New();
-	inbox->front->next = inbox->back;
+/* Start time of a traced span, or zero when tracing is off. */
+long _Trace_Begin(void) {
+	return MIMPI_trace_path ? _MIMPI_Clock() : 0;
 }
 
-void Inbox_Destroy(
-	struct Inbox *inbox
+char const *_Trace_Tag_Name(
+	int tag
 ) {
-	struct Inbox_Message *message = inbox->front;
-	while (message) {
-		struct Inbox_Message *freeable = message;
-		message = message->next;
-		ASSERT_SYS_OK(sem_destroy(&freeable->available));
-		if (freeable->data) free(freeable->data);
-		free(freeable);
+	switch (tag) {
+		case MIMPI_GROUP_TAG: return "group";
+		case MIMPI_CLOSE_TAG: return "close";
+		case MIMPI_PROBE_TAG: return "probe";
+		case MIMPI_RENDEZVOUS_TAG: return "rendezvous";
+		case MIMPI_CLEAR_TAG: return "clear";
+		case MIMPI_PAYLOAD_TAG: return "payload";
+		case MIMPI_DEADLOCK_TAG: return "deadlock";
+		default: return "message";
 	}
 }
 
-void Inbox_Save_Message(
-	struct Inbox *inbox,
+/* Must be called in the order messages go on the wire to destination. */
+void _Trace_Sent(
+	int destination,
 	int tag,
-	size_t size,
-	void *data
+	size_t bytes,
+	long begin
 ) {
-	_Inbox_Save(inbox, INBOX_MESSAGE, tag, size, data);
+	if (!begin) return;
+
+	_Trace_Add(TRACE_SENT, _Trace_Tag_Name(tag), begin, destination, tag,
+		bytes, MIMPI_trace_sent[destination]++);
 }
 
-void Inbox_Save_Request(
-	struct Inbox *inbox,
+/* Must be called in the order messages come off the wire from source. */
+void _Trace_Received(
+	int source,
 	int tag,
-	size_t size
+	size_t bytes,
+	long begin
 ) {
-	_Inbox_Save(inbox, INBOX_REQUEST, tag, size, NULL);
+	if (!begin) return;
+
+	_Trace_Add(TRACE_RECEIVED, _Trace_Tag_Name(tag), begin, source, tag,
+		bytes, MIMPI_trace_received[source]++);
 }
 
-void Inbox_Close(
-	struct Inbox *inbox
+void _Trace_Time(
+	FILE *file,
+	char const *key,
+	long nanoseconds
 ) {
-	_Inbox_Save(inbox, INBOX_CLOSE, 0, 0, NULL);
+	fprintf(file, ",\"%s\":%ld.%03ld", key, nanoseconds / 1000,
+		nanoseconds % 1000);
 }
 
-MIMPI_Retcode Inbox_Retrieve(
-	struct Inbox *inbox,
-	int tag,
-	size_t size,
-	void *data
+void _Trace_Write(
+	FILE *file,
+	struct Trace const *trace,
+	struct Trace_Event const *event
 ) {
-	struct Inbox_Message* previous = NULL;
-	struct Inbox_Message* message = inbox->front;
+	int rank = MIMPI_World_rank();
+	int source = event->kind == TRACE_SENT ? rank : event->peer;
+	int destination = event->kind == TRACE_SENT ? event->peer : rank;
+
+	fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d",
+		event->name, rank, trace->thread);
+	_Trace_Time(file, "ts", event->begin);
+	_Trace_Time(file, "dur", event->end - event->begin);
+	fprintf(file, ",\"args\":{\"bytes\":%zu", event->bytes);
+
+	if (event->kind == TRACE_CALL) {
+		fprintf(file, "}}");
+		return;
+	}
 
-	while (true) {
-		previous = message;
-		message = message->next;
-		ASSERT_SYS_OK(sem_wait(&message->available));
-		ASSERT_SYS_OK(sem_post(&message->available));
+	fprintf(file, ",\"%s\":%d,\"tag\":%d,\"id\":\"%d.%d.%lu\"}}",
+		event->kind == TRACE_SENT ? "to" : "from", event->peer, event->tag,
+		source, destination, event->sequence);
+
+	/* The flow starts and finishes inside the slices written above. */
+	fprintf(file, ",\n{\"name\":\"message\",\"cat\":\"message\","
+		"\"ph\":\"%c\",\"pid\":%d,\"tid\":%d",
+		event->kind == TRACE_SENT ? 's' : 'f', rank, trace->thread);
+	_Trace_Time(file, "ts", event->begin);
+	fprintf(file, ",\"id\":\"%d.%d.%lu\"%s}", source, destination,
+		event->sequence, event->kind == TRACE_SENT ? "" : ",\"bp\":\"e\"");
+}
 
-		if (message->type == INBOX_CLOSE)
-			return MIMPI_ERROR_REMOTE_FINISHED;
+/* Writes out and frees the buffers of all threads, which must have stopped. */
+void _Trace_Dump(void) {
+	if (!MIMPI_trace_path) return;
 
-		if (message->type == INBOX_REQUEST) {
-			if (!MIMPI_deadlock_detection) continue;
+	int rank = MIMPI_World_rank();
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s.%d.json", MIMPI_trace_path, rank);
+	FILE *file = fopen(path, "w");
+	if (!file) syserr("Cannot open trace %s", path);
 
-			size_t size = message->size;
-			int tag = message->tag;
+	fprintf(file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"rank %d\"}}", rank, rank);
 
-			previous->next = _Inbox_Delete(message);
-			message = previous;
+	for (struct Trace *trace = atomic_exchange(&MIMPI_traces, NULL); trace;) {
+		fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+			"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", rank, trace->thread,
+			trace->name);
 
-			if (Outbox_Pop(&MIMPI_outboxes[inbox->rank], size, 
-				tag))
-				continue;
+		for (size_t i = 0; i < trace->count; i++)
+			_Trace_Write(file, trace, &trace->events[i]);
 
-			return MIMPI_ERROR_DEADLOCK_DETECTED;
-		}
+		struct Trace *next = trace->next;
+		free(trace->events);
+		free(trace);
+		trace = next;
+	}
 
-		if (message->type == INBOX_DEADLOCK) {
-			if (!MIMPI_deadlock_detection) continue;
+	fprintf(file, "\n]\n");
+	ASSERT_ZERO(fclose(file));
 
-			previous->next = _Inbox_Delete(message);
-			message = previous;
+	MIMPI_trace = NULL;
+	free(MIMPI_trace_sent);
+	free(MIMPI_trace_received);
+}
 
-			continue;
-		}
+/*** Profiling ***************************************************************/
+
+static const char *MIMPI_profile_names[] = {
+	[PROFILE_SEND] = "send",
+	[PROFILE_RECV] = "recv",
+	[PROFILE_BARRIER] = "barrier",
+	[PROFILE_BCAST] = "bcast",
+	[PROFILE_REDUCE] = "reduce",
+	[PROFILE_ALLREDUCE] = "allreduce",
+	[PROFILE_REDUCE_SCATTER] = "reduce_scatter",
+	[PROFILE_GATHER] = "gather",
+	[PROFILE_SCATTER] = "scatter",
+	[PROFILE_ALLGATHER] = "allgather",
+	[PROFILE_ALLTOALL] = "alltoall",
+	[PROFILE_WRITE] = "write"
+};
 
-		if (message->type == INBOX_MESSAGE &&
-			_Inbox_Match(message, tag, size)) {
-			memmove(data, message->data, size);
+/*
+    MIMPI_PROFILE enables the counters, which each rank writes out to the
+    file named by its value followed by a dot and the rank at
+    MIMPI_Finalize. Every thread counts into its own block, linked once
+    into a global list, so nothing on the hot path takes a lock.
+*/
+void _Profile_Init(void) {
+	MIMPI_profile_path = getenv("MIMPI_PROFILE");
+}
 
-			previous->next = _Inbox_Delete(message);
+struct Profile *_Profile_Local(void) {
+	if (MIMPI_profile) return MIMPI_profile;
 
-			return MIMPI_SUCCESS;
-		}
-	}
+	size_t peers = MIMPI_World_size() * sizeof(struct Profile_Peer);
+	struct Profile *profile = (struct Profile*)calloc(1,
+		sizeof(struct Profile) + peers);
+	ASSERT_NOT_NULL(profile);
+
+	profile->next = atomic_load(&MIMPI_profiles);
+	while (!atomic_compare_exchange_weak(&MIMPI_profiles, &profile->next,
+		profile));
 
-	return MIMPI_ERROR_REMOTE_FINISHED;
+	return MIMPI_profile = profile;
 }
 
-/*** Channel communications **************************************************/
+/* Start time of a profiled or traced call, or zero when both are off. */
+long _Profile_Begin(void) {
+	return MIMPI_profile_path || MIMPI_trace_path ? _MIMPI_Clock() : 0;
+}
 
-ssize_t chrecv_all(int fd, void *buffer, size_t count) {
-	ssize_t total = 0;
+void _Profile_End(
+	Profile_Call call,
+	long begin,
+	size_t bytes
+) {
+	if (!begin) return;
 
-	while (count > 0) {
-		ssize_t result = chrecv(fd, buffer, count);
+	if (MIMPI_trace_path)
+		_Trace_Add(TRACE_CALL, MIMPI_profile_names[call], begin, -1, 0, bytes,
+			0);
 
-		if (result <= 0) {
-			return -1;
-		}
+	if (!MIMPI_profile_path) return;
 
-		count -= result;
-		total += result;
-		buffer += result;
-	}
+	unsigned long elapsed = _MIMPI_Clock() - begin;
+	int bucket = elapsed ? 64 - __builtin_clzl(elapsed) : 0;
+	if (bucket >= MIMPI_PROFILE_BUCKETS) bucket = MIMPI_PROFILE_BUCKETS - 1;
 
-	return total;
+	struct Profile_Histogram *histogram = &_Profile_Local()->calls[call];
+	histogram->count++;
+	histogram->bytes += bytes;
+	histogram->nanoseconds += elapsed;
+	histogram->buckets[bucket]++;
 }
 
+void _Profile_Sent(
+	int destination,
+	size_t bytes
+) {
+	if (!MIMPI_profile_path) return;
 
-ssize_t chsend_all(int fd, const void *buffer, size_t count) {
-	ssize_t total = count;
+	struct Profile_Peer *peer = &_Profile_Local()->peers[destination];
+	peer->sent_messages++;
+	peer->sent_bytes += bytes;
+}
 
-	while (count > 0) {
-		ssize_t result = chsend(fd, buffer, count);
+void _Profile_Received(
+	int source,
+	size_t bytes
+) {
+	if (!MIMPI_profile_path) return;
 
-		if (result == -1) {
-			return -1;
+	struct Profile_Peer *peer = &_Profile_Local()->peers[source];
+	peer->received_messages++;
+	peer->received_bytes += bytes;
+}
+
+/*
+    Sums the blocks of all threads, which must have stopped, and writes one
+    line per counter: its dotted name and value. Frees the blocks.
+*/
+void _Profile_Dump(void) {
+	if (!MIMPI_profile_path) return;
+
+	int size = MIMPI_World_size();
+	struct Profile *total = (struct Profile*)calloc(1,
+		sizeof(struct Profile) + size * sizeof(struct Profile_Peer));
+	ASSERT_NOT_NULL(total);
+
+	for (struct Profile *profile = atomic_exchange(&MIMPI_profiles, NULL);
+		profile;) {
+		for (int call = 0; call < PROFILE_CALLS; call++) {
+			struct Profile_Histogram *from = &profile->calls[call];
+			struct Profile_Histogram *into = &total->calls[call];
+
+			into->count += from->count;
+			into->bytes += from->bytes;
+			into->nanoseconds += from->nanoseconds;
+			for (int i = 0; i < MIMPI_PROFILE_BUCKETS; i++)
+				into->buckets[i] += from->buckets[i];
 		}
 
-		count -= result;
-		buffer += result;
+		for (int rank = 0; rank < size; rank++) {
+			struct Profile_Peer *from = &profile->peers[rank];
+			struct Profile_Peer *into = &total->peers[rank];
+
+			into->sent_messages += from->sent_messages;
+			into->sent_bytes += from->sent_bytes;
+			into->received_messages += from->received_messages;
+			into->received_bytes += from->received_bytes;
+		}
+
+		struct Profile *next = profile->next;
+		free(profile);
+		profile = next;
 	}
 
-	return total;
-}
+	MIMPI_profile = NULL;
 
-/*** Receiver ****************************************************************/
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s.%d", MIMPI_profile_path, MIMPI_World_rank());
+	FILE *file = fopen(path, "w");
+	if (!file) syserr("Cannot open profile %s", path);
 
-bool _Receiver_Receive(
-	int *tag,
-	size_t *size,
-	void **data,
-	int fd
-) {
-	prefix_t prefix;
+	for (int call = 0; call < PROFILE_CALLS; call++) {
+		struct Profile_Histogram *histogram = &total->calls[call];
+		char const *name = MIMPI_profile_names[call];
 
-	if (chrecv_all(fd, &prefix, sizeof(prefix_t)) <= 0)
-		return false;
+		if (!histogram->count) continue;
 
-	*tag = prefix.header.tag;
-	*size = prefix.header.size;
+		fprintf(file, "call.%s.count %lu\n", name, histogram->count);
+		fprintf(file, "call.%s.bytes %lu\n", name, histogram->bytes);
+		fprintf(file, "call.%s.ns %lu\n", name, histogram->nanoseconds);
 
-	if (!*size)
-		return true;
-
-	*data = malloc(*size);
-	ASSERT_NOT_NULL(*data);
-
-	size_t prefix_count = *size;
-	if (prefix_count > MIMPI_PREFIX_SIZE) prefix_count = MIMPI_PREFIX_SIZE;
-	size_t suffix_count = *size - prefix_count;
+		for (int i = 0; i < MIMPI_PROFILE_BUCKETS; i++)
+			if (histogram->buckets[i])
+				fprintf(file, "call.%s.below_ns.%lu %lu\n", name, 1ul << i,
+					histogram->buckets[i]);
+	}
 
-	memmove(*data, &prefix.data, prefix_count);
+	for (int rank = 0; rank < size; rank++) {
+		struct Profile_Peer *peer = &total->peers[rank];
 
-	if (*size <= MIMPI_PREFIX_SIZE)
-		return true;
+		if (rank == MIMPI_World_rank()) continue;
 
-	if (chrecv_all(fd, *data + MIMPI_PREFIX_SIZE, suffix_count) <= 0) {
-		free(*data);
-		return false;
+		fprintf(file, "peer.%d.sent.messages %lu\n", rank,
+			peer->sent_messages);
+		fprintf(file, "peer.%d.sent.bytes %lu\n", rank, peer->sent_bytes);
+		fprintf(file, "peer.%d.received.messages %lu\n", rank,
+			peer->received_messages);
+		fprintf(file, "peer.%d.received.bytes %lu\n", rank,
+			peer->received_bytes);
+		fprintf(file, "peer.%d.unexpected.max %zu\n", rank,
+			MIMPI_inboxes[rank].max_depth);
 	}
 
-	return true;
+	ASSERT_ZERO(fclose(file));
+	free(total);
 }
 
-void *Receiver_Main(
-	void* raw_inbox
-) {
-	struct Inbox* inbox = (struct Inbox*)raw_inbox;
-
-	int fd = MIMPI_CHANNEL_READER + inbox->rank;
-	int tag;
-	size_t size;
-	void *data;
-
-	while (_Receiver_Receive(&tag, &size, &data, fd)) {
-		if (tag == MIMPI_CLOSE_TAG) break;
+/*** Inbox index *************************************************************/
 
-		if (tag == MIMPI_REQUEST_TAG) {
-			header_t *header = (header_t*)data;
-			Inbox_Save_Request(inbox, header->tag, header->size);
-			free(data);
-			continue;
-		}
+size_t _Index_Bucket(
+	int index,
+	int tag,
+	int context,
+	size_t size
+) {
+	size_t hash = size * 0x9E3779B97F4A7C15ull;
+	if (index == MIMPI_INDEX_KEY)
+		hash ^= ((unsigned int)tag ^ (unsigned int)context * 0xC2B2AE35u) *
+			0x85EBCA6Bu;
 
-		Inbox_Save_Message(inbox, tag, size, data);
-	}
+	return (hash ^ hash >> 29) & (MIMPI_INDEX_BUCKETS - 1);
+}
 
-	ASSERT_SYS_OK(close(fd));
+void _Index_Push(
+	struct Inbox *inbox,
+	int index,
+	struct Inbox_Message *message
+) {
+	struct Inbox_Queue *queue = &inbox->index[index][_Index_Bucket(index,
+		message->tag, message->context, message->size)];
+	struct Inbox_Link *link = &message->links[index];
 
-	Inbox_Close(inbox);
+	link->previous = queue->back;
+	link->next = NULL;
 
-	return NULL;
+	if (queue->back) queue->back->links[index].next = message;
+	else queue->front = message;
+	queue->back = message;
 }
 
-/*** Direct communication ****************************************************/
-
-MIMPI_Retcode _MIMPI_Send_Data(
-	prefix_t const *prefix,
-	void const *data,
-	size_t data_count,
-	int fd
+void _Index_Remove(
+	struct Inbox *inbox,
+	int index,
+	struct Inbox_Message *message
 ) {
-	if (chsend_all(fd, prefix, sizeof(prefix_t)) != sizeof(prefix_t))
-		return MIMPI_ERROR_REMOTE_FINISHED;
-
-	if (!data || !data_count)
-		return MIMPI_SUCCESS;
+	struct Inbox_Queue *queue = &inbox->index[index][_Index_Bucket(index,
+		message->tag, message->context, message->size)];
+	struct Inbox_Link *link = &message->links[index];
 
-	if (chsend_all(fd, data, data_count) != data_count)
-		return MIMPI_ERROR_REMOTE_FINISHED;
+	if (link->previous) link->previous->links[index].next = link->next;
+	else queue->front = link->next;
 
-	return MIMPI_SUCCESS;
+	if (link->next) link->next->links[index].previous = link->previous;
+	else queue->back = link->previous;
 }
 
-MIMPI_Retcode _MIMPI_Send(
-	void const *data,
-	size_t count,
-	int destination,
-	int tag
+/* Oldest message with exactly given tag, context and size in the bucket. */
+struct Inbox_Message *_Index_Find(
+	struct Inbox *inbox,
+	int index,
+	size_t bucket,
+	int tag,
+	int context,
+	size_t size
 ) {
-	if (destination == MIMPI_World_rank()) {
-		return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-	}
+	struct Inbox_Message *message = inbox->index[index][bucket].front;
 
-	if (destination < 0 || destination >= MIMPI_World_size())
-		return MIMPI_ERROR_NO_SUCH_RANK;
+	for (; message; message = message->links[index].next) {
+		if (message->size != size || message->context != context) continue;
 
-	prefix_t prefix;
-	memset(&prefix, 0, sizeof(prefix_t));
+		if (index == MIMPI_INDEX_KEY ? message->tag == tag : message->tag >= 0)
+			return message;
+	}
 
-	prefix.header.size = count;
-	prefix.header.tag = tag;
+	return NULL;
+}
 
-	size_t prefix_count =
-		count < MIMPI_PREFIX_SIZE ? count : MIMPI_PREFIX_SIZE;
-	size_t suffix_count = (size_t)count - prefix_count;
+/* Must be called with inbox lock held. */
+void Index_Insert(
+	struct Inbox *inbox,
+	struct Inbox_Message *message
+) {
+	message->sequence = inbox->sequence++;
 
-	memcpy(&prefix.data, data, prefix_count);
+	_Index_Push(inbox, MIMPI_INDEX_KEY, message);
+	_Index_Push(inbox, MIMPI_INDEX_SIZE, message);
 
-	return _MIMPI_Send_Data(&prefix, data + prefix_count, suffix_count,
-		MIMPI_CHANNEL_WRITER + destination);
+	if (++inbox->depth > inbox->max_depth) inbox->max_depth = inbox->depth;
 }
 
-MIMPI_Retcode _MIMPI_Recv(
-	void *data,
-	size_t count,
-	int source,
-	int tag
+/* Must be called with inbox lock held. */
+void Index_Remove(
+	struct Inbox *inbox,
+	struct Inbox_Message *message
 ) {
-	return Inbox_Retrieve(&MIMPI_inboxes[source], tag, count, data);
+	_Index_Remove(inbox, MIMPI_INDEX_KEY, message);
+	_Index_Remove(inbox, MIMPI_INDEX_SIZE, message);
+	inbox->depth--;
 }
 
-/*** Deadlock detection ******************************************************/
-
-MIMPI_Retcode _MIMPI_Deadlock_Request(
-	size_t count,
-	int source,
-	int tag
+/*
+    Computes the buckets a receive looks its matches up in, once per post,
+    so that persistent receives and receives from any source rescanning
+    the inboxes reuse them.
+*/
+void Index_Prepare(
+	struct Inbox_Post *post
 ) {
-	if (!MIMPI_deadlock_detection) return MIMPI_SUCCESS;
-
-	header_t header;
-	memset(&header, 0, sizeof(header_t));
-	header.size = count;
-	header.tag = tag;
-
-	prefix_t prefix;
-	memset(&prefix, 0, sizeof(prefix_t));
-	prefix.header.size = sizeof(header_t);
-	prefix.header.tag = MIMPI_REQUEST_TAG;
-	memmove(&prefix.data, &header, sizeof(header_t));
-
-	return _MIMPI_Send_Data(&prefix, NULL, 0,
-		MIMPI_CHANNEL_WRITER + source);
+	if (post->tag == MIMPI_ANY_TAG)
+		post->buckets[0] = _Index_Bucket(MIMPI_INDEX_SIZE, post->tag,
+			post->context, post->size);
+	else
+		post->buckets[0] = _Index_Bucket(MIMPI_INDEX_KEY, post->tag,
+			post->context, post->size);
+
+	post->buckets[1] = _Index_Bucket(MIMPI_INDEX_KEY, MIMPI_ANY_TAG,
+		post->context, post->size);
+	post->indexed = true;
 }
 
-/*** Group communication *****************************************************/
-
-MIMPI_Retcode _MIMPI_Collect(
-	int parent,
-	int children[MIMPI_CHILDREN],
-	void const *send_data,
-	void *recv_data,
-	size_t count,
-	MIMPI_Op op
+/*
+    Oldest message matching the receive, as _MIMPI_Match would pick it by
+    scanning. Wildcard receives go straight to the per-size chain.
+    Must be called with inbox lock held.
+*/
+struct Inbox_Message *Index_Match(
+	struct Inbox *inbox,
+	struct Inbox_Post *post
 ) {
-	size_t size = count + sizeof(MIMPI_Retcode);
+	int tag = post->tag;
+	int context = post->context;
+	size_t size = post->size;
 
-	uint8_t *data = (uint8_t*)malloc(size);
-	ASSERT_NOT_NULL(data);
+	if (!post->indexed) Index_Prepare(post);
 
-	MIMPI_Retcode *status = (MIMPI_Retcode*)(data + count);
+	if (tag == MIMPI_ANY_TAG)
+		return _Index_Find(inbox, MIMPI_INDEX_SIZE, post->buckets[0], tag,
+			context, size);
 
-	uint8_t *child_data = (uint8_t*)malloc(size);
-	ASSERT_NOT_NULL(child_data);
+	struct Inbox_Message *exact = _Index_Find(inbox, MIMPI_INDEX_KEY,
+		post->buckets[0], tag, context, size);
 
-	MIMPI_Retcode *child_status = (MIMPI_Retcode*)(child_data + count);
+	if (tag < 0)
+		return exact;
 
-	if (count) memcpy(data, send_data, count);
-	*status = MIMPI_SUCCESS;
+	/* Messages sent with the wildcard tag match any user tag. */
+	struct Inbox_Message *wildcard = _Index_Find(inbox, MIMPI_INDEX_KEY,
+		post->buckets[1], MIMPI_ANY_TAG, context, size);
 
-	for (int i = 0; i < MIMPI_CHILDREN; i++) {
-		if (children[i] == -1) continue;
+	if (!exact || (wildcard && wildcard->sequence < exact->sequence))
+		return wildcard;
 
-		MIMPI_Retcode retcode =
-			_MIMPI_Recv(child_data, size, children[i], MIMPI_GROUP_TAG);
+	return exact;
+}
 
-		*status = _MIMPI_Update_Retcode(*status, retcode);
+/*** Inbox helpers ***********************************************************/
 
-		if (retcode != MIMPI_SUCCESS) continue;
+/* Pools below must be used with inbox lock held. */
+struct Inbox_Message *_Inbox_New(
+	struct Inbox *inbox
+) {
+	struct Inbox_Message *result = inbox->free_messages;
 
-		*status = _MIMPI_Update_Retcode(*status, *child_status);
-		_MIMPI_Reduce(data, child_data, count, op);
+	if (result) {
+		inbox->free_messages = result->next;
+		inbox->stats.message_hits++;
+	} else {
+		result = (struct Inbox_Message*)malloc(sizeof(struct Inbox_Message));
+		ASSERT_NOT_NULL(result);
+		inbox->stats.message_misses++;
 	}
 
-	free(child_data);
+	result->next = NULL;
+	result->type = INBOX_MESSAGE;
+	result->tag = 0;
+	result->context = 0;
+	result->size = 0;
+	result->data = NULL;
+	result->pool = -1;
+	result->post = NULL;
+
+	return result;
+}
 
-	if (recv_data && count) memcpy(recv_data, data, count);
+/* Smallest size class holding size bytes, -1 if they are left to malloc. */
+int _Inbox_Class(
+	size_t size
+) {
+	for (int pool = 0; pool < MIMPI_POOL_CLASSES; pool++)
+		if (size <= (size_t)1 << (MIMPI_POOL_MIN_SHIFT + pool))
+			return pool;
 
-	if (parent != -1) {
-		MIMPI_Retcode retcode =
-			_MIMPI_Send(data, size, parent, MIMPI_GROUP_TAG);
+	return -1;
+}
 
-		*status = _MIMPI_Update_Retcode(*status, retcode);
+void *_Inbox_Alloc(
+	struct Inbox *inbox,
+	size_t size,
+	int *pool
+) {
+	*pool = _Inbox_Class(size);
+
+	if (*pool != -1 && inbox->free_buffers[*pool]) {
+		struct Inbox_Buffer *buffer = inbox->free_buffers[*pool];
+		inbox->free_buffers[*pool] = buffer->next;
+		inbox->free_counts[*pool]--;
+		inbox->stats.buffer_hits++;
+		return buffer;
 	}
 
-	MIMPI_Retcode retcode = *status;
+	if (*pool != -1) size = (size_t)1 << (MIMPI_POOL_MIN_SHIFT + *pool);
 
-	free(data);
+	void *data = malloc(size);
+	ASSERT_NOT_NULL(data);
+	inbox->stats.buffer_misses++;
 
-	return retcode;
+	return data;
 }
 
-MIMPI_Retcode _MIMPI_Distribute(
-	int parent,
-	int children[MIMPI_CHILDREN],
-	void *recv_data,
-	size_t count,
-	MIMPI_Retcode initial_status
+void _Inbox_Release(
+	struct Inbox *inbox,
+	void *data,
+	int pool
 ) {
-	size_t size = count + sizeof(MIMPI_Retcode);
+	if (pool == -1 || inbox->free_counts[pool] == MIMPI_POOL_DEPTH) {
+		free(data);
+		return;
+	}
 
-	uint8_t *data = (uint8_t*)malloc(size);
-	ASSERT_NOT_NULL(data);
+	struct Inbox_Buffer *buffer = (struct Inbox_Buffer*)data;
+	buffer->next = inbox->free_buffers[pool];
+	inbox->free_buffers[pool] = buffer;
+	inbox->free_counts[pool]++;
+}
 
-	MIMPI_Retcode *status = (MIMPI_Retcode*)(data + count);
-	*status = initial_status;
+/* Signals the owner of the inbox, unless nobody waits. */
+void _Inbox_Wake(
+	struct Inbox *inbox
+) {
+	if (inbox->waiters)
+		ASSERT_ZERO(pthread_cond_broadcast(&inbox->changed));
+}
 
-	if (parent == -1) {
-		if (count) memcpy(data, recv_data, count);
-	} else {
-		MIMPI_Retcode retcode =
-			_MIMPI_Recv(data, size, parent, MIMPI_GROUP_TAG);
+/* Signals receives from any source that some inbox may match now. */
+void _Inbox_Arrived(void) {
+	atomic_fetch_add(&MIMPI_arrivals, 1);
 
-		*status = _MIMPI_Update_Retcode(*status, retcode);
-	}
+	if (atomic_load(&MIMPI_arrival_waiters))
+		syscall(SYS_futex, &MIMPI_arrivals, FUTEX_WAKE, INT32_MAX, NULL,
+			NULL, 0);
+}
 
-	for (int i = 0; i < MIMPI_CHILDREN; i++) {
-		if (children[i] == -1) continue;
+void _Inbox_Complete(
+	struct Inbox_Post *post,
+	MIMPI_Retcode retcode
+) {
+	post->retcode = retcode;
+	post->delivered = true;
+}
 
-		MIMPI_Retcode retcode =
-			_MIMPI_Send(data, size, children[i], MIMPI_GROUP_TAG);
+void _Inbox_Post(
+	struct Inbox *inbox,
+	struct Inbox_Post *post
+) {
+	struct Inbox_Post **last = &inbox->posted;
+	while (*last) last = &(*last)->next;
 
-		*status = _MIMPI_Update_Retcode(*status, retcode);
-	}
+	post->next = NULL;
+	*last = post;
+}
 
-	if (parent != -1 && *status == MIMPI_SUCCESS)
-		memmove(recv_data, data, count);
+/* Whether no message has been matched to the post yet. */
+bool _Inbox_Posted(
+	struct Inbox *inbox,
+	struct Inbox_Post *post
+) {
+	struct Inbox_Post *current = inbox->posted;
+	while (current && current != post) current = current->next;
 
-	MIMPI_Retcode retcode = *status;
+	return current != NULL;
+}
 
-	free(data);
+/* Must be called with inbox lock held. */
+bool _Inbox_Unpost(
+	struct Inbox *inbox,
+	struct Inbox_Post *post
+) {
+	struct Inbox_Post **current = &inbox->posted;
+	while (*current && *current != post) current = &(*current)->next;
 
-	return retcode;
+	bool found = *current != NULL;
+	if (found) *current = post->next;
+
+	return found;
 }
 
-/*** MIMPI interface *********************************************************/
+/* Must be called with inbox lock held. */
+struct Inbox_Message *_Inbox_Delete(
+	struct Inbox *inbox,
+	struct Inbox_Message *message
+) {
+	struct Inbox_Message *next = message->next;
 
-void MIMPI_Init(bool enable_deadlock_detection) {
-	channels_init();
+	if (message->data) _Inbox_Release(inbox, message->data, message->pool);
 
-	MIMPI_deadlock_detection = enable_deadlock_detection;
+	message->next = inbox->free_messages;
+	inbox->free_messages = message;
 
-	MIMPI_inboxes =
-		(struct Inbox*)malloc(MIMPI_World_size() *
-		sizeof(struct Inbox));
-	ASSERT_NOT_NULL(MIMPI_inboxes);
+	return next;
+}
 
-	MIMPI_receivers =
-		(pthread_t*)malloc(MIMPI_World_size() * sizeof(pthread_t));
-	ASSERT_NOT_NULL(MIMPI_receivers);
+/*** Inbox interface *********************************************************/
 
-	if (MIMPI_deadlock_detection) {
-		MIMPI_outboxes =
-			(struct Outbox*)malloc(MIMPI_World_size() *
-			sizeof(struct Outbox));
-		ASSERT_NOT_NULL(MIMPI_outboxes);
+void Inbox_Init(
+	struct Inbox *inbox,
+	int rank
+) {
+	inbox->rank = rank;
+	inbox->posted = NULL;
+	inbox->cleared = NULL;
+	memset(inbox->index, 0, sizeof(inbox->index));
+	inbox->sequence = 0;
+	inbox->depth = 0;
+	inbox->max_depth = 0;
+	inbox->waits = 0;
+	inbox->probe = 0;
+	inbox->probe_ack = 0;
+	inbox->deadlock = 0;
+	inbox->collectives = 0;
+	inbox->closed = false;
+	inbox->free_messages = NULL;
+	memset(&inbox->stats, 0, sizeof(inbox->stats));
+	for (int pool = 0; pool < MIMPI_POOL_CLASSES; pool++) {
+		inbox->free_buffers[pool] = NULL;
+		inbox->free_counts[pool] = 0;
 	}
+	inbox->waiters = 0;
+	ASSERT_ZERO(pthread_mutex_init(&inbox->lock, NULL));
+
+	/* Deadlines of deadlock detection are taken from the monotonic clock. */
+	pthread_condattr_t attributes;
+	ASSERT_ZERO(pthread_condattr_init(&attributes));
+	ASSERT_ZERO(pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC));
+	ASSERT_ZERO(pthread_cond_init(&inbox->changed, &attributes));
+	ASSERT_ZERO(pthread_condattr_destroy(&attributes));
+}
 
-	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
-		if (rank == MIMPI_World_rank()) continue;
+void Inbox_Destroy(
+	struct Inbox *inbox
+) {
+	for (int bucket = 0; bucket < MIMPI_INDEX_BUCKETS; bucket++) {
+		struct Inbox_Queue *queue = &inbox->index[MIMPI_INDEX_SIZE][bucket];
 
-		Inbox_Init(&MIMPI_inboxes[rank], rank);
+		while (queue->front) {
+			struct Inbox_Message *message = queue->front;
+			Index_Remove(inbox, message);
+			_Inbox_Delete(inbox, message);
+		}
+	}
 
-		if (MIMPI_outboxes)
-			Outbox_Init(&MIMPI_outboxes[rank]);
+	while (inbox->free_messages) {
+		struct Inbox_Message *freeable = inbox->free_messages;
+		inbox->free_messages = freeable->next;
+		free(freeable);
+	}
 
-		ASSERT_ZERO(pthread_create(&MIMPI_receivers[rank],
-			NULL, Receiver_Main,
-			(struct Inbox*)&MIMPI_inboxes[rank]));
+	for (int pool = 0; pool < MIMPI_POOL_CLASSES; pool++) {
+		while (inbox->free_buffers[pool]) {
+			struct Inbox_Buffer *freeable = inbox->free_buffers[pool];
+			inbox->free_buffers[pool] = freeable->next;
+			free(freeable);
+		}
 	}
+
+	ASSERT_ZERO(pthread_cond_destroy(&inbox->changed));
+	ASSERT_ZERO(pthread_mutex_destroy(&inbox->lock));
 }
 
-void MIMPI_Finalize() {
-	channels_finalize();
+/* Completes a post the receiver thread has written the payload for. */
+void Inbox_Deliver(
+	struct Inbox *inbox,
+	struct Inbox_Post *post
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	post->delivered = true;
+	_Inbox_Wake(inbox);
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
 
-	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
-		if (rank == MIMPI_World_rank()) continue;
+/*
+    Queues an unexpected message whose payload is still being read into a
+    pooled buffer, so that the lock need not be held meanwhile.
+    Must be called with inbox lock held.
+*/
+struct Inbox_Message *Inbox_Save_Pending(
+	struct Inbox *inbox,
+	int tag,
+	int context,
+	size_t size
+) {
+	struct Inbox_Message *message = _Inbox_New(inbox);
 
-		prefix_t prefix;
-		memset(&prefix, 0, sizeof(prefix_t));
+	message->type = INBOX_PENDING;
+	message->tag = tag;
+	message->context = context;
+	message->size = size;
+	if (size) message->data = _Inbox_Alloc(inbox, size, &message->pool);
 
-		prefix.header.tag = MIMPI_CLOSE_TAG;
-		prefix.header.size = 0;
+	Index_Insert(inbox, message);
+	_Inbox_Arrived();
 
-		_MIMPI_Send_Data(&prefix, NULL, 0, MIMPI_CHANNEL_WRITER + rank);
-		ASSERT_SYS_OK(close(MIMPI_CHANNEL_WRITER + rank));
-	}
+	return message;
+}
 
-	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
-		if (rank == MIMPI_World_rank()) continue;
+/*
+    Finishes a pending message, handing it to the receive that attached to
+    it in the meantime, if any. Must be called with inbox lock held.
+*/
+void Inbox_Complete_Pending(
+	struct Inbox *inbox,
+	struct Inbox_Message *message,
+	bool received
+) {
+	struct Inbox_Post *post = message->post;
 
-		ASSERT_ZERO(pthread_join(MIMPI_receivers[rank], NULL));
+	if (!post && received) {
+		message->type = INBOX_MESSAGE;
+		return;
+	}
 
-		Inbox_Destroy(&MIMPI_inboxes[rank]);
-		if (MIMPI_outboxes) Outbox_Destroy(&MIMPI_outboxes[rank]);
+	/* Attached messages have already left the index. */
+	if (!post) {
+		Index_Remove(inbox, message);
+		_Inbox_Delete(inbox, message);
+		return;
 	}
 
-	free(MIMPI_receivers);
-	free(MIMPI_inboxes);
-	if (MIMPI_outboxes) free(MIMPI_outboxes);
-}
+	if (received && message->size)
+		memmove(post->data, message->data, message->size);
+	post->retcode = received ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
 
-int MIMPI_World_size() {
-	static int mimpi_size = -1;
-	if (mimpi_size == -1)
-		ASSERT_SYS_OK(readenv(&mimpi_size, "MIMPI_SIZE"));
+	_Inbox_Delete(inbox, message);
 
-	return mimpi_size;
+	post->delivered = true;
+	_Inbox_Wake(inbox);
 }
 
-int MIMPI_World_rank() {
-	static int mimpi_rank = -1;
-	if (mimpi_rank == -1)
-		ASSERT_SYS_OK(readenv(&mimpi_rank, "MIMPI_RANK"));
+/* Must be called with inbox lock held. */
+struct Inbox_Post *Inbox_Take_Post(
+	struct Inbox *inbox,
+	int tag,
+	int context,
+	size_t size
+) {
+	struct Inbox_Post **current = &inbox->posted;
 
-	return mimpi_rank;
-}
+	while (*current) {
+		struct Inbox_Post *post = *current;
 
-MIMPI_Retcode MIMPI_Send(
-	void const *data,
-	int count,
-	int destination,
-	int tag
-) {
-	MIMPI_Retcode retcode = _MIMPI_Send(data, count, destination, tag);
+		if (post->context == context &&
+			_MIMPI_Match(post->size, post->tag, size, tag)) {
+			*current = post->next;
+			post->tag = tag;
+			return post;
+		}
 
-	if (MIMPI_outboxes && retcode == MIMPI_SUCCESS)
-		Outbox_Push(&MIMPI_outboxes[destination], tag, count);
+		current = &post->next;
+	}
 
-	return retcode;
+	return NULL;
 }
 
-MIMPI_Retcode MIMPI_Recv(
-	void *data,
-	int count,
-	int source,
-	int tag
+/*
+    Queues an announced message, or attaches it to a matching receive right
+    away, in which case returns true and the sender has to be cleared.
+*/
+bool Inbox_Announce(
+	struct Inbox *inbox,
+	int tag,
+	int context,
+	size_t size,
+	unsigned long handle
 ) {
-	if (source == MIMPI_World_rank()) {
-		return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-	}
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
 
-	if (source < 0 || source >= MIMPI_World_size()) {
-		return MIMPI_ERROR_NO_SUCH_RANK;
-	}
+	struct Inbox_Message *message = _Inbox_New(inbox);
 
-	MIMPI_Retcode retcode = _MIMPI_Deadlock_Request(count, source, tag);
+	message->type = INBOX_RENDEZVOUS;
+	message->tag = tag;
+	message->context = context;
+	message->size = size;
+	message->handle = handle;
+	message->post = Inbox_Take_Post(inbox, tag, context, size);
 
-	if (retcode != MIMPI_SUCCESS)
-		return retcode;
+	if (message->post) {
+		message->next = inbox->cleared;
+		inbox->cleared = message;
+	} else {
+		Index_Insert(inbox, message);
+		_Inbox_Arrived();
+	}
 
-	return _MIMPI_Recv(data, count, source, tag);
-}
+	bool cleared = message->post != NULL;
 
-MIMPI_Retcode MIMPI_Barrier() {
-	const int root = 0;
-	int parent, children[MIMPI_CHILDREN];
-	_MIMPI_Get_Neighbours(&parent, children, MIMPI_World_rank(), root,
-		MIMPI_World_size());
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
 
-	MIMPI_Retcode retcode = MIMPI_SUCCESS;
-	retcode = _MIMPI_Collect(parent, children, NULL, NULL, 0, MIMPI_NOOP);
-	retcode = _MIMPI_Distribute(parent, children, NULL, 0, retcode);
-	return retcode;
+	return cleared;
 }
 
-MIMPI_Retcode MIMPI_Bcast(void *data, int count, int root) {
+/* Receive that the announced payload with given handle is meant for. */
+struct Inbox_Post *Inbox_Take_Cleared(
+	struct Inbox *inbox,
+	unsigned long handle
+) {
+	struct Inbox_Post *post = NULL;
+
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+
+	struct Inbox_Message **current = &inbox->cleared;
+	while (*current && (*current)->handle != handle)
+		current = &(*current)->next;
+
+	if (*current) {
+		struct Inbox_Message *message = *current;
+		*current = message->next;
+		post = message->post;
+		_Inbox_Delete(inbox, message);
+	}
+
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return post;
+}
+
+void Inbox_Close(
+	struct Inbox *inbox
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	inbox->closed = true;
+
+	/* Payloads of cleared messages will not come anymore. */
+	while (inbox->cleared) {
+		struct Inbox_Message *message = inbox->cleared;
+		inbox->cleared = message->next;
+		_Inbox_Complete(message->post, MIMPI_ERROR_REMOTE_FINISHED);
+		_Inbox_Delete(inbox, message);
+	}
+
+	_Inbox_Wake(inbox);
+	_Inbox_Arrived();
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
+
+/* Whether the peer finished, and if so how many collectives it joined. */
+bool Inbox_Finished(
+	struct Inbox *inbox,
+	unsigned long *collectives
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	bool closed = inbox->closed;
+	*collectives = inbox->collectives;
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return closed;
+}
+
+/* Adds allocator counters of the inbox to stats. */
+void Inbox_Statistics(
+	struct Inbox *inbox,
+	MIMPI_Pool_Stats *stats
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	stats->message_hits += inbox->stats.message_hits;
+	stats->message_misses += inbox->stats.message_misses;
+	stats->buffer_hits += inbox->stats.buffer_hits;
+	stats->buffer_misses += inbox->stats.buffer_misses;
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
+
+/*
+    Takes a buffered message matching the post, recording its tag there.
+    Must be called with inbox lock held.
+*/
+Inbox_Match_Result _Inbox_Match(
+	struct Inbox *inbox,
+	struct Inbox_Post *post,
+	unsigned long *handle
+) {
+	struct Inbox_Message *message = Index_Match(inbox, post);
+
+	if (!message) return INBOX_MISSED;
+
+	Index_Remove(inbox, message);
+	post->tag = message->tag;
+
+	/* Receiver thread completes the post once the payload is in. */
+	if (message->type == INBOX_PENDING) {
+		message->post = post;
+	} else if (message->type == INBOX_RENDEZVOUS && inbox->closed) {
+		_Inbox_Delete(inbox, message);
+		_Inbox_Complete(post, MIMPI_ERROR_REMOTE_FINISHED);
+	} else if (message->type == INBOX_RENDEZVOUS) {
+		message->post = post;
+		message->next = inbox->cleared;
+		inbox->cleared = message;
+		*handle = message->handle;
+		return INBOX_CLEARED;
+	} else {
+		if (post->size) memmove(post->data, message->data, post->size);
+		_Inbox_Delete(inbox, message);
+		_Inbox_Complete(post, MIMPI_SUCCESS);
+	}
+
+	return INBOX_MATCHED;
+}
+
+/*
+    Takes a buffered message matching the post or leaves the post pending.
+    Returns true if the post attached to an announced message, whose sender
+    has to be cleared with the handle stored.
+*/
+bool Inbox_Match_Or_Post(
+	struct Inbox *inbox,
+	struct Inbox_Post *post,
+	unsigned long *handle
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+
+	Inbox_Match_Result result = _Inbox_Match(inbox, post, handle);
+
+	if (result == INBOX_MISSED && inbox->closed)
+		_Inbox_Complete(post, MIMPI_ERROR_REMOTE_FINISHED);
+	else if (result == INBOX_MISSED)
+		_Inbox_Post(inbox, post);
+
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return result == INBOX_CLEARED;
+}
+
+/* Like Inbox_Match_Or_Post, but never leaves the post pending. */
+Inbox_Match_Result Inbox_Try_Match(
+	struct Inbox *inbox,
+	struct Inbox_Post *post,
+	unsigned long *handle,
+	bool *closed
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+
+	Inbox_Match_Result result = _Inbox_Match(inbox, post, handle);
+	*closed = inbox->closed;
+
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return result;
+}
+
+/* Sleeps until some message arrives after arrivals were counted. */
+void Inbox_Await_Arrival(
+	unsigned int arrivals
+) {
+	atomic_fetch_add(&MIMPI_arrival_waiters, 1);
+
+	if (atomic_load(&MIMPI_arrivals) == arrivals)
+		syscall(SYS_futex, &MIMPI_arrivals, FUTEX_WAIT, arrivals, NULL,
+			NULL, 0);
+
+	atomic_fetch_sub(&MIMPI_arrival_waiters, 1);
+}
+
+/* Records a probe of the peer, which waits for us. */
+void Inbox_Probe(
+	struct Inbox *inbox,
+	probe_t const *probe
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	inbox->probe = probe->wait;
+	inbox->probe_ack = probe->ack;
+	_Inbox_Wake(inbox);
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
+
+/* Records that the peer found our wait with given id deadlocked. */
+void Inbox_Deadlock(
+	struct Inbox *inbox,
+	unsigned long wait
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	inbox->deadlock = wait;
+	_Inbox_Wake(inbox);
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
+
+/* Fails the post unless some message has been matched to it meanwhile. */
+void Inbox_Fail(
+	struct Inbox *inbox,
+	struct Inbox_Post *post,
+	MIMPI_Retcode retcode
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	if (_Inbox_Unpost(inbox, post)) _Inbox_Complete(post, retcode);
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+}
+
+/* Whether the wait should go back to deadlock detection. */
+bool _Inbox_Detect(
+	struct Inbox *inbox,
+	struct Inbox_Detection *detection
+) {
+	if (!detection->expired) {
+		struct timespec now;
+		ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &now));
+
+		if (now.tv_sec < detection->deadline.tv_sec ||
+			(now.tv_sec == detection->deadline.tv_sec &&
+			now.tv_nsec < detection->deadline.tv_nsec))
+			return false;
+
+		detection->expired = true;
+	} else if (inbox->probe == detection->probe &&
+		inbox->probe_ack == detection->ack) {
+		return false;
+	}
+
+	detection->probe = inbox->probe;
+	detection->ack = inbox->probe_ack;
+	return true;
+}
+
+/*
+    Waits until the post completes. With detection given, also returns true
+    once its timeout expires, and after that whenever the peer probes us,
+    as long as the post is unmatched. A deadlock found by the peer fails it.
+*/
+bool Inbox_Wait(
+	struct Inbox *inbox,
+	struct Inbox_Post *post,
+	bool block,
+	struct Inbox_Detection *detection
+) {
+	bool detect = false;
+
+	/* Takes the lock only to sleep or see why the post is not delivered. */
+	if (block) {
+		long deadline = _Spin_Begin();
+		unsigned long spins = 0;
+
+		while (!post->delivered && _Spin_Continue(deadline, &spins));
+	}
+
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+
+	while (!post->delivered) {
+		bool posted = detection && _Inbox_Posted(inbox, post);
+
+		/* Peer may close right after telling us about the deadlock. */
+		if (posted && inbox->deadlock == detection->wait) {
+			_Inbox_Unpost(inbox, post);
+			_Inbox_Complete(post, MIMPI_ERROR_DEADLOCK_DETECTED);
+			break;
+		}
+
+		/* Receiver thread may already be writing into our buffer. */
+		if (inbox->closed && _Inbox_Unpost(inbox, post)) {
+			_Inbox_Complete(post, MIMPI_ERROR_REMOTE_FINISHED);
+			break;
+		}
+
+		if (posted && _Inbox_Detect(inbox, detection)) {
+			detect = true;
+			break;
+		}
+
+		if (!block) break;
+
+		inbox->waiters++;
+		if (posted && !detection->expired)
+			pthread_cond_timedwait(&inbox->changed, &inbox->lock,
+				&detection->deadline);
+		else
+			ASSERT_ZERO(pthread_cond_wait(&inbox->changed, &inbox->lock));
+		inbox->waiters--;
+	}
+
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return detect;
+}
+
+/*** Channel communications **************************************************/
+
+ssize_t chrecv_all(int fd, void *buffer, size_t count) {
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t result = chrecv(fd, buffer, count);
+
+		if (result <= 0) {
+			return -1;
+		}
+
+		count -= result;
+		total += result;
+		buffer += result;
+	}
+
+	return total;
+}
+
+
+ssize_t chsend_all(int fd, const void *buffer, size_t count) {
+	ssize_t total = count;
+
+	while (count > 0) {
+		ssize_t result = chsend(fd, buffer, count);
+
+		if (result == -1) {
+			return -1;
+		}
+
+		count -= result;
+		buffer += result;
+	}
+
+	return total;
+}
+
+/* Like chrecv_all, but serves small reads from bytes read ahead. */
+ssize_t chrecv_buffered(int fd, struct Channel_Buffer *ahead, void *buffer,
+	size_t count) {
+	ssize_t total = count;
+
+	while (count > 0) {
+		size_t available = ahead->end - ahead->begin;
+
+		if (available) {
+			size_t chunk = count < available ? count : available;
+			memcpy(buffer, ahead->data + ahead->begin, chunk);
+
+			ahead->begin += chunk;
+			buffer += chunk;
+			count -= chunk;
+			continue;
+		}
+
+		_Spin_Readable(fd);
+
+		/* Large payloads go straight to their destination. */
+		if (count >= MIMPI_READ_AHEAD)
+			return chrecv_all(fd, buffer, count) == -1 ? -1 : total;
+
+		ssize_t result = chrecv(fd, ahead->data, MIMPI_READ_AHEAD);
+
+		if (result <= 0) {
+			return -1;
+		}
+
+		ahead->begin = 0;
+		ahead->end = result;
+	}
+
+	return total;
+}
+
+/* Like chsend_all, but gathers the buffers with writev; consumes vector. */
+ssize_t chsendv_all(int fd, struct iovec *vector, int count) {
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t result = writev(fd, vector, count < IOV_MAX ? count : IOV_MAX);
+
+		if (result == -1) {
+			return -1;
+		}
+
+		total += result;
+
+		while (count > 0 && (size_t)result >= vector->iov_len) {
+			result -= vector->iov_len;
+			vector++;
+			count--;
+		}
+
+		if (count > 0) {
+			vector->iov_base += result;
+			vector->iov_len -= result;
+		}
+	}
+
+	return total;
+}
+
+/*** Affinity ****************************************************************/
+
+/*
+    MIMPI_CPUS, set by mimpirun from its MIMPI_BIND policy, lists the CPU of
+    every rank. The main thread is pinned to the CPU of its rank, threads
+    serving it are kept on the same NUMA node, and memory received into
+    is preferably placed on the node of the receiving rank.
+*/
+void _Affinity_Init(void) {
+	char *list = getenv("MIMPI_CPUS");
+	if (!list) return;
+
+	int size = MIMPI_World_size();
+	int *cpus = (int*)malloc(size * sizeof(int));
+	ASSERT_NOT_NULL(cpus);
+
+	if (MIMPI_Cpu_List(list, cpus, size) != size)
+		fatal("MIMPI_CPUS must list a CPU for each of %d ranks", size);
+
+	MIMPI_nodes = (int*)malloc(size * sizeof(int));
+	ASSERT_NOT_NULL(MIMPI_nodes);
+
+	for (int rank = 0; rank < size; rank++)
+		MIMPI_nodes[rank] = MIMPI_Cpu_Node(cpus[rank]);
+
+	int cpu = cpus[MIMPI_World_rank()];
+	int node_cpus[CPU_SETSIZE];
+	int count = MIMPI_Node_Cpus(MIMPI_nodes[MIMPI_World_rank()], node_cpus,
+		CPU_SETSIZE);
+
+	CPU_ZERO(&MIMPI_helper_cpus);
+	CPU_SET(cpu, &MIMPI_helper_cpus);
+	for (int i = 0; i < count; i++)
+		CPU_SET(node_cpus[i], &MIMPI_helper_cpus);
+
+	cpu_set_t own;
+	CPU_ZERO(&own);
+	CPU_SET(cpu, &own);
+	ASSERT_ZERO(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		&own));
+
+	free(cpus);
+}
+
+/* Keeps the calling library thread on the NUMA node of this rank. */
+void _Affinity_Helper(void) {
+	if (!MIMPI_nodes) return;
+
+	ASSERT_ZERO(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		&MIMPI_helper_cpus));
+}
+
+/*
+    Prefers the NUMA node of rank for pages of memory not touched yet. This
+    is only a hint, kernels without NUMA support refuse it harmlessly.
+*/
+void _Affinity_Place(
+	void *memory,
+	size_t size,
+	int rank
+) {
+	if (!MIMPI_nodes || MIMPI_nodes[rank] >= MIMPI_MAX_NODES) return;
+
+	unsigned long mask[MIMPI_MAX_NODES / (8 * sizeof(unsigned long))];
+	memset(mask, 0, sizeof(mask));
+	mask[MIMPI_nodes[rank] / (8 * sizeof(unsigned long))] |=
+		1ul << MIMPI_nodes[rank] % (8 * sizeof(unsigned long));
+
+	syscall(SYS_mbind, memory, size, MPOL_PREFERRED, mask,
+		MIMPI_MAX_NODES, 0);
+}
+
+/*** Shared memory ***********************************************************/
+
+struct MIMPI_Ring *_Ring_Map(
+	int fd
+) {
+	void *ring = mmap(NULL, MIMPI_Ring_Size(MIMPI_ring_capacity),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		syserr("mmap of shared memory ring failed");
+
+	ASSERT_SYS_OK(close(fd));
+
+	return (struct MIMPI_Ring*)ring;
+}
+
+/* Creating process owns the ring, the peer maps it from the handshake. */
+int _Ring_Create(
+	struct MIMPI_Ring **ring,
+	int destination
+) {
+	int fd = memfd_create("mimpi-ring", MFD_CLOEXEC);
+	ASSERT_SYS_OK(fd);
+	ASSERT_SYS_OK(ftruncate(fd, MIMPI_Ring_Size(MIMPI_ring_capacity)));
+
+	int shared = dup(fd);
+	ASSERT_SYS_OK(shared);
+	*ring = _Ring_Map(fd);
+	_Affinity_Place(*ring, MIMPI_Ring_Size(MIMPI_ring_capacity), destination);
+
+	return shared;
+}
+
+void _Ring_Unmap(
+	struct MIMPI_Ring *ring
+) {
+	if (ring)
+		ASSERT_SYS_OK(munmap(ring, MIMPI_Ring_Size(MIMPI_ring_capacity)));
+}
+
+int _Ring_Wake_Reader(
+	struct MIMPI_Ring *ring,
+	int fd
+) {
+	if (!atomic_load(&ring->reader_waiting) ||
+		!atomic_exchange(&ring->reader_waiting, 0))
+		return 0;
+
+	char token = 0;
+	if (chsend(fd, &token, 1) != 1)
+		return -1;
+
+	return 0;
+}
+
+void _Ring_Wake_Writer(
+	struct MIMPI_Ring *ring
+) {
+	if (!atomic_load(&ring->writer_waiting) ||
+		!atomic_exchange(&ring->writer_waiting, 0))
+		return;
+
+	atomic_fetch_add(&ring->space, 1);
+	syscall(SYS_futex, &ring->space, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+int _Ring_Wait_Data(
+	struct MIMPI_Ring *ring,
+	int fd,
+	size_t tail
+) {
+	long deadline = _Spin_Begin();
+	unsigned long spins = 0;
+
+	while (atomic_load(&ring->head) == tail &&
+		_Spin_Continue(deadline, &spins));
+
+	if (atomic_load(&ring->head) != tail) return 0;
+
+	atomic_store(&ring->reader_waiting, 1);
+
+	if (atomic_load(&ring->head) != tail) {
+		atomic_exchange(&ring->reader_waiting, 0);
+		return 0;
+	}
+
+	char tokens[64];
+	if (chrecv(fd, tokens, sizeof(tokens)) > 0)
+		return 0;
+
+	/* Writer is gone, but whatever it managed to write is still valid. */
+	atomic_exchange(&ring->reader_waiting, 0);
+	return atomic_load(&ring->head) != tail ? 0 : -1;
+}
+
+int _Ring_Wait_Space(
+	struct MIMPI_Ring *ring,
+	int fd,
+	size_t head
+) {
+	unsigned int space = atomic_load(&ring->space);
+	atomic_store(&ring->writer_waiting, 1);
+
+	if (head - atomic_load(&ring->tail) < MIMPI_ring_capacity)
+		return 0;
+
+	struct timespec timeout = { 0, MIMPI_RING_TIMEOUT_NS };
+	if (syscall(SYS_futex, &ring->space, FUTEX_WAIT, space, &timeout,
+		NULL, 0) == 0 || errno != ETIMEDOUT)
+		return 0;
+
+	/* Reader never drains a ring whose pipe end it has already closed. */
+	struct pollfd writer = { .fd = fd, .events = POLLOUT };
+	ASSERT_SYS_OK(poll(&writer, 1, 0));
+
+	return writer.revents & POLLERR ? -1 : 0;
+}
+
+/* Copies consecutive buffers into the ring, publishing each fill at once. */
+ssize_t _Ring_Sendv(
+	struct MIMPI_Ring *ring,
+	int fd,
+	struct iovec const *vector,
+	int count
+) {
+	ssize_t total = _MIMPI_Vector_Size(vector, count);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t done = 0;
+
+	while (count > 0) {
+		size_t tail = atomic_load(&ring->tail);
+		size_t space = MIMPI_ring_capacity - (head - tail);
+
+		if (space == 0) {
+			if (_Ring_Wait_Space(ring, fd, head) == -1)
+				return -1;
+			continue;
+		}
+
+		while (count > 0 && space > 0) {
+			size_t chunk = vector->iov_len - done;
+			if (chunk > space) chunk = space;
+
+			size_t offset = head & (MIMPI_ring_capacity - 1);
+			size_t first = MIMPI_ring_capacity - offset;
+			if (first > chunk) first = chunk;
+
+			void const *buffer = vector->iov_base + done;
+			memcpy(ring->data + offset, buffer, first);
+			memcpy(ring->data, buffer + first, chunk - first);
+
+			head += chunk;
+			space -= chunk;
+			done += chunk;
+
+			if (done == vector->iov_len) {
+				vector++;
+				count--;
+				done = 0;
+			}
+		}
+
+		atomic_store(&ring->head, head);
+
+		if (_Ring_Wake_Reader(ring, fd) == -1)
+			return -1;
+	}
+
+	return total;
+}
+
+ssize_t _Ring_Recv(
+	struct MIMPI_Ring *ring,
+	int fd,
+	void *buffer,
+	size_t count
+) {
+	ssize_t total = count;
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	while (count > 0) {
+		size_t head = atomic_load(&ring->head);
+
+		if (head == tail) {
+			if (_Ring_Wait_Data(ring, fd, tail) == -1)
+				return -1;
+			continue;
+		}
+
+		size_t chunk = count < head - tail ? count : head - tail;
+		size_t offset = tail & (MIMPI_ring_capacity - 1);
+		size_t first = MIMPI_ring_capacity - offset;
+		if (first > chunk) first = chunk;
+
+		memcpy(buffer, ring->data + offset, first);
+		memcpy(buffer + first, ring->data, chunk - first);
+
+		tail += chunk;
+		buffer += chunk;
+		count -= chunk;
+
+		atomic_store(&ring->tail, tail);
+
+		_Ring_Wake_Writer(ring);
+	}
+
+	return total;
+}
+
+void _Shm_Init(void) {
+	char *capacity = getenv("MIMPI_SHM_RING");
+	if (!capacity) return;
+
+	MIMPI_ring_capacity = strtoull(capacity, NULL, 10);
+	MIMPI_shm_size = MIMPI_Shm_Size(MIMPI_World_size());
+
+	MIMPI_shm = mmap(NULL, MIMPI_shm_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, MIMPI_SHM_FD, 0);
+	if (MIMPI_shm == MAP_FAILED)
+		syserr("mmap of shared memory states failed");
+
+	ASSERT_SYS_OK(close(MIMPI_SHM_FD));
+}
+
+void _Shm_Finalize(void) {
+	if (!MIMPI_shm) return;
+
+	ASSERT_SYS_OK(munmap(MIMPI_shm, MIMPI_shm_size));
+	MIMPI_shm = NULL;
+}
+
+void _Shm_Changed(
+	struct MIMPI_Rank_State *state
+) {
+	atomic_fetch_add(&state->changed, 1);
+
+	if (atomic_load(&state->waiters))
+		syscall(SYS_futex, &state->changed, FUTEX_WAKE, INT32_MAX, NULL,
+			NULL, 0);
+}
+
+/* Whether rank shares the states with us, the others run on other hosts. */
+bool _Shm_Local(
+	int rank
+) {
+	return !MIMPI_hosts ||
+		strcmp(MIMPI_hosts[rank], MIMPI_hosts[MIMPI_World_rank()]) == 0;
+}
+
+/*
+    Whether a rank on another host finished before joining the current
+    collective, known once its close arrives. It is not waited for.
+*/
+bool _Shm_Remote_Missing(
+	int rank
+) {
+	unsigned long collectives;
+
+	return Inbox_Finished(&MIMPI_inboxes[rank], &collectives) &&
+		collectives < MIMPI_collectives;
+}
+
+/* Opens a collective, reporting ranks that finished without joining it. */
+MIMPI_Retcode _Shm_Collective_Begin(void) {
+	if (!MIMPI_shm) return MIMPI_SUCCESS;
+
+	unsigned long collectives = ++MIMPI_collectives;
+	struct MIMPI_Rank_State *own = MIMPI_Shm_State(MIMPI_shm,
+		MIMPI_World_rank());
+	atomic_store(&own->collectives, collectives);
+	_Shm_Changed(own);
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		struct MIMPI_Rank_State *state = MIMPI_Shm_State(MIMPI_shm, rank);
+
+		if (!_Shm_Local(rank)) {
+			if (_Shm_Remote_Missing(rank)) return MIMPI_ERROR_REMOTE_FINISHED;
+			continue;
+		}
+
+		if (atomic_load(&state->finished) &&
+			atomic_load(&state->collectives) < collectives)
+			return MIMPI_ERROR_REMOTE_FINISHED;
+	}
+
+	return MIMPI_SUCCESS;
+}
+
+/* Waits until rank joins the current collective or finishes without it. */
+MIMPI_Retcode _Shm_Collective_Await(
+	int rank
+) {
+	if (!MIMPI_shm) return MIMPI_SUCCESS;
+
+	if (!_Shm_Local(rank))
+		return _Shm_Remote_Missing(rank) ?
+			MIMPI_ERROR_REMOTE_FINISHED : MIMPI_SUCCESS;
+
+	struct MIMPI_Rank_State *state = MIMPI_Shm_State(MIMPI_shm, rank);
+	MIMPI_Retcode retcode = MIMPI_SUCCESS;
+
+	atomic_fetch_add(&state->waiters, 1);
+
+	while (true) {
+		unsigned int changed = atomic_load(&state->changed);
+
+		if (atomic_load(&state->collectives) >= MIMPI_collectives)
+			break;
+
+		if (atomic_load(&state->finished)) {
+			retcode = MIMPI_ERROR_REMOTE_FINISHED;
+			break;
+		}
+
+		syscall(SYS_futex, &state->changed, FUTEX_WAIT, changed, NULL,
+			NULL, 0);
+	}
+
+	atomic_fetch_sub(&state->waiters, 1);
+
+	return retcode;
+}
+
+void _Shm_Finish(void) {
+	if (!MIMPI_shm) return;
+
+	struct MIMPI_Rank_State *own = MIMPI_Shm_State(MIMPI_shm,
+		MIMPI_World_rank());
+	atomic_store(&own->finished, 1);
+	_Shm_Changed(own);
+}
+
+/*** Channels ****************************************************************/
+
+#define MIMPI_HANDSHAKE_FDS 2
+
+/* Hands over up to MIMPI_HANDSHAKE_FDS descriptors, -1 if peer is gone. */
+int _Channel_Handshake(
+	int destination,
+	int const *fds,
+	int count
+) {
+	int id;
+	ASSERT_SYS_OK(readenv(&id, "MIMPI_CHANNEL_ID"));
+
+	struct sockaddr_un address;
+	socklen_t length = MIMPI_Channel_Address(&address, id, destination);
+
+	int peer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	ASSERT_SYS_OK(peer);
+
+	int rank = MIMPI_World_rank();
+	struct iovec payload = { .iov_base = &rank, .iov_len = sizeof(int) };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(MIMPI_HANDSHAKE_FDS * sizeof(int))];
+	} control;
+
+	struct msghdr message = { .msg_iov = &payload, .msg_iovlen = 1 };
+
+	if (count) {
+		message.msg_control = control.buffer;
+		message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+		struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(count * sizeof(int));
+		memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+	}
+
+	int result = 0;
+	if (connect(peer, (struct sockaddr*)&address, length) == -1 ||
+		sendmsg(peer, &message, MSG_NOSIGNAL) == -1)
+		result = -1;
+
+	ASSERT_SYS_OK(close(peer));
+
+	return result;
+}
+
+/* Accepts one handshake, returning the number of handed over descriptors. */
+int _Channel_Accept(
+	int *source,
+	int *fds
+) {
+	int peer = accept(MIMPI_LISTEN_FD, NULL, NULL);
+	ASSERT_SYS_OK(peer);
+
+	struct iovec payload = { .iov_base = source, .iov_len = sizeof(int) };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(MIMPI_HANDSHAKE_FDS * sizeof(int))];
+	} control;
+
+	struct msghdr message = {
+		.msg_iov = &payload,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof(control.buffer)
+	};
+
+	if (recvmsg(peer, &message, MSG_CMSG_CLOEXEC) != sizeof(int))
+		fatal("Malformed channel handshake");
+	ASSERT_SYS_OK(close(peer));
+
+	struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+	if (!header || header->cmsg_type != SCM_RIGHTS)
+		return 0;
+
+	int count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+
+	return count;
+}
+
+/* Opens a pipe, with a ring if shared memory is used, to a local peer. */
+int _Local_Open(
+	int destination
+) {
+	int fds[MIMPI_HANDSHAKE_FDS];
+	ASSERT_SYS_OK(channel(fds));
+	int writer = fds[1];
+	int count = 1;
+
+	struct MIMPI_Ring *ring = NULL;
+	if (MIMPI_ring_capacity)
+		fds[count++] = _Ring_Create(&ring, destination);
+
+	int result = _Channel_Handshake(destination, fds, count);
+
+	for (int i = 0; i < count; i++)
+		ASSERT_SYS_OK(close(fds[i]));
+
+	if (result == -1) {
+		ASSERT_SYS_OK(close(writer));
+		_Ring_Unmap(ring);
+		return -1;
+	}
+
+	MIMPI_out_rings[destination] = ring;
+
+	return writer;
+}
+
+void _Local_Refuse(
+	int destination
+) {
+	_Channel_Handshake(destination, NULL, 0);
+}
+
+/*** TCP *********************************************************************/
+
+/*
+    Rank listens on port MIMPI_TCP_PORT plus its number. Peers connect once
+    they first send to it, or in MIMPI_Finalize if they never did, and say
+    who they are in a hello. The socket then carries the channel one way.
+*/
+void _Tcp_Listen(void) {
+	MIMPI_tcp_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	ASSERT_SYS_OK(MIMPI_tcp_listener);
+
+	int one = 1;
+	ASSERT_SYS_OK(setsockopt(MIMPI_tcp_listener, SOL_SOCKET, SO_REUSEADDR,
+		&one, sizeof(int)));
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(struct sockaddr_in));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(MIMPI_tcp_port + MIMPI_World_rank());
+
+	if (bind(MIMPI_tcp_listener, (struct sockaddr*)&address,
+		sizeof(struct sockaddr_in)) == -1)
+		syserr("Cannot listen on TCP port %d",
+			MIMPI_tcp_port + MIMPI_World_rank());
+
+	ASSERT_SYS_OK(listen(MIMPI_tcp_listener, SOMAXCONN));
+}
+
+int _Tcp_Connect(
+	int destination
+) {
+	char port[16];
+	snprintf(port, sizeof(port), "%d", MIMPI_tcp_port + destination);
+
+	struct addrinfo hints, *addresses;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int error = getaddrinfo(MIMPI_hosts[destination], port, &hints,
+		&addresses);
+	if (error)
+		fatal("Cannot resolve host %s of rank %d: %s",
+			MIMPI_hosts[destination], destination, gai_strerror(error));
+
+	long deadline = _MIMPI_Clock() + MIMPI_TCP_TIMEOUT;
+	int peer = -1;
+
+	/* Peer may not listen yet, but never stops before our handshake. */
+	while (peer == -1) {
+		for (struct addrinfo *address = addresses; address && peer == -1;
+			address = address->ai_next) {
+			peer = socket(address->ai_family,
+				address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+			ASSERT_SYS_OK(peer);
+
+			if (connect(peer, address->ai_addr, address->ai_addrlen) == -1) {
+				ASSERT_SYS_OK(close(peer));
+				peer = -1;
+			}
+		}
+
+		if (peer == -1) {
+			if (_MIMPI_Clock() > deadline)
+				syserr("Cannot reach rank %d at %s:%s", destination,
+					MIMPI_hosts[destination], port);
+
+			usleep(MIMPI_TCP_RETRY / 1000);
+		}
+	}
+
+	freeaddrinfo(addresses);
+
+	int one = 1;
+	ASSERT_SYS_OK(setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &one,
+		sizeof(int)));
+
+	return peer;
+}
+
+int _Tcp_Handshake(
+	int destination,
+	bool open
+) {
+	int peer = _Tcp_Connect(destination);
+	hello_t hello = { MIMPI_World_rank(), open, MIMPI_collectives };
+
+	if (chsend_all(peer, &hello, sizeof(hello_t)) == -1 || !open) {
+		ASSERT_SYS_OK(close(peer));
+		return -1;
+	}
+
+	return peer;
+}
+
+int _Tcp_Open(
+	int destination
+) {
+	return _Tcp_Handshake(destination, true);
+}
+
+void _Tcp_Refuse(
+	int destination
+) {
+	_Tcp_Handshake(destination, false);
+}
+
+/* Accepts one hello, returning the socket in fds unless peer refused it. */
+int _Tcp_Accept(
+	int *source,
+	int *fds
+) {
+	int peer = accept4(MIMPI_tcp_listener, NULL, NULL, SOCK_CLOEXEC);
+	ASSERT_SYS_OK(peer);
+
+	hello_t hello;
+	if (chrecv_all(peer, &hello, sizeof(hello_t)) != sizeof(hello_t))
+		fatal("Malformed channel handshake");
+
+	*source = hello.rank;
+
+	if (!hello.open) {
+		if (hello.rank >= 0 && hello.rank < MIMPI_World_size())
+			MIMPI_inboxes[hello.rank].collectives = hello.collectives;
+
+		ASSERT_SYS_OK(close(peer));
+		return 0;
+	}
+
+	fds[0] = peer;
+
+	return 1;
+}
+
+/*** Transport ***************************************************************/
+
+ssize_t _Stream_Sendv(
+	int destination,
+	struct iovec *vector,
+	int count
+) {
+	return chsendv_all(MIMPI_writers[destination], vector, count);
+}
+
+ssize_t _Stream_Recv(
+	int source,
+	void *buffer,
+	size_t count
+) {
+	return chrecv_buffered(MIMPI_readers[source], MIMPI_read_buffers[source],
+		buffer, count);
+}
+
+/* Whether bytes were read ahead from the stream, which poll cannot see. */
+bool _Stream_Buffered(
+	int source
+) {
+	struct Channel_Buffer *ahead = MIMPI_read_buffers[source];
+
+	return ahead->begin != ahead->end;
+}
+
+ssize_t _Ring_Channel_Sendv(
+	int destination,
+	struct iovec *vector,
+	int count
+) {
+	return _Ring_Sendv(MIMPI_out_rings[destination],
+		MIMPI_writers[destination], vector, count);
+}
+
+ssize_t _Ring_Channel_Recv(
+	int source,
+	void *buffer,
+	size_t count
+) {
+	return _Ring_Recv(MIMPI_in_rings[source], MIMPI_readers[source], buffer,
+		count);
+}
+
+bool _Ring_Channel_Buffered(
+	int source
+) {
+	(void)source;
+	return false;
+}
+
+static struct Transport const MIMPI_pipe_transport = {
+	_Local_Open, _Local_Refuse, _Stream_Sendv, _Stream_Recv, _Stream_Buffered
+};
+
+static struct Transport const MIMPI_ring_transport = {
+	_Local_Open, _Local_Refuse, _Ring_Channel_Sendv, _Ring_Channel_Recv,
+	_Ring_Channel_Buffered
+};
+
+static struct Transport const MIMPI_tcp_transport = {
+	_Tcp_Open, _Tcp_Refuse, _Stream_Sendv, _Stream_Recv, _Stream_Buffered
+};
+
+/*
+    MIMPI_HOSTS, set by mimpirun when launching from a hostfile, names the
+    host of every rank. Peers on our host are reached through pipes, with
+    rings if shared memory is used, the others over TCP.
+*/
+void _Transport_Init(void) {
+	int size = MIMPI_World_size();
+	MIMPI_transports = (struct Transport const**)malloc(size *
+		sizeof(struct Transport const*));
+	ASSERT_NOT_NULL(MIMPI_transports);
+
+	for (int rank = 0; rank < size; rank++)
+		MIMPI_transports[rank] = MIMPI_ring_capacity ?
+			&MIMPI_ring_transport : &MIMPI_pipe_transport;
+
+	char *hosts = getenv("MIMPI_HOSTS");
+	if (!hosts) return;
+
+	ASSERT_SYS_OK(readenv(&MIMPI_tcp_port, "MIMPI_TCP_PORT"));
+
+	MIMPI_hosts = (char**)malloc(size * sizeof(char*));
+	ASSERT_NOT_NULL(MIMPI_hosts);
+
+	/* Names point into a single copy of the list, starting at the first. */
+	char *list = strdup(hosts);
+	ASSERT_NOT_NULL(list);
+
+	for (int rank = 0; rank < size; rank++) {
+		MIMPI_hosts[rank] = strsep(&list, ",");
+		if (!MIMPI_hosts[rank])
+			fatal("MIMPI_HOSTS must name a host for each of %d ranks", size);
+	}
+
+	bool remote = false;
+	for (int rank = 0; rank < size; rank++) {
+		if (strcmp(MIMPI_hosts[rank], MIMPI_hosts[MIMPI_World_rank()]) != 0) {
+			MIMPI_transports[rank] = &MIMPI_tcp_transport;
+			remote = true;
+		}
+	}
+
+	if (remote) _Tcp_Listen();
+}
+
+void _Transport_Finalize(void) {
+	if (MIMPI_hosts) free(MIMPI_hosts[0]);
+	free(MIMPI_hosts);
+	free(MIMPI_transports);
+}
+
+/* Opens the channel to destination on first use, -1 if it is gone. */
+int _Channel_Writer(
+	int destination
+) {
+	if (MIMPI_writers[destination] != -1)
+		return MIMPI_writers[destination];
+
+	int writer = MIMPI_transports[destination]->open(destination);
+
+	if (writer != -1)
+		MIMPI_writers[destination] = writer;
+
+	return writer;
+}
+
+/* Lets destination know that we finished, opening the channel if needed. */
+void _Channel_Close(
+	int destination
+) {
+	if (MIMPI_writers[destination] == -1) {
+		MIMPI_transports[destination]->refuse(destination);
+		return;
+	}
+
+	ASSERT_SYS_OK(close(MIMPI_writers[destination]));
+	MIMPI_writers[destination] = -1;
+
+	_Ring_Unmap(MIMPI_out_rings[destination]);
+	MIMPI_out_rings[destination] = NULL;
+}
+
+/* Sends the buffers back to back, vector may be consumed meanwhile. */
+ssize_t _MIMPI_Channel_Sendv(
+	int destination,
+	struct iovec *vector,
+	int count
+) {
+	if (_Channel_Writer(destination) == -1)
+		return -1;
+
+	long begin = _Profile_Begin();
+	ssize_t result =
+		MIMPI_transports[destination]->sendv(destination, vector, count);
+	_Profile_End(PROFILE_WRITE, begin, result > 0 ? result : 0);
+
+	return result;
+}
+
+ssize_t _MIMPI_Channel_Recv(
+	int source,
+	void *buffer,
+	size_t count
+) {
+	return MIMPI_transports[source]->recv(source, buffer, count);
+}
+
+bool _MIMPI_Channel_Buffered(
+	int source
+) {
+	return MIMPI_transports[source]->buffered(source);
+}
+
+/*** Direct communication ****************************************************/
+
+/* Sends a header, a control body and data gathered in a single write. */
+MIMPI_Retcode _MIMPI_Send_Data(
+	int tag,
+	int context,
+	void const *body,
+	size_t body_count,
+	struct iovec const *data,
+	int data_count,
+	int destination
+) {
+	header_t header;
+	memset(&header, 0, sizeof(header_t));
+	header.size = body_count + _MIMPI_Vector_Size(data, data_count);
+	header.tag = tag;
+	header.context = context;
+	_Profile_Sent(destination, header.size);
+
+	struct iovec buffer[MIMPI_VECTOR_SIZE];
+	struct iovec *vector = buffer;
+
+	if (data_count + 2 > MIMPI_VECTOR_SIZE) {
+		vector = (struct iovec*)malloc((data_count + 2) * sizeof(struct iovec));
+		ASSERT_NOT_NULL(vector);
+	}
+
+	int count = 0;
+	vector[count++] = (struct iovec){ &header, sizeof(header_t) };
+	if (body_count) vector[count++] = (struct iovec){ (void*)body, body_count };
+
+	for (int i = 0; i < data_count; i++)
+		if (data[i].iov_len) vector[count++] = data[i];
+
+	ssize_t total = sizeof(header_t) + header.size;
+	long begin = _Trace_Begin();
+	MIMPI_Retcode retcode =
+		_MIMPI_Channel_Sendv(destination, vector, count) == total ?
+		MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+	_Trace_Sent(destination, tag, header.size, begin);
+
+	if (vector != buffer) free(vector);
+
+	return retcode;
+}
+
+/* Builds the header and vector of a persistent send once for all its runs. */
+void _MIMPI_Send_Prepare(
+	struct MIMPI_Request_Data *request
+) {
+	memset(&request->header, 0, sizeof(header_t));
+	request->header.size = request->size;
+	request->header.tag = request->tag;
+	request->header.context = request->context;
+
+	request->wire[0] = (struct iovec){ &request->header, sizeof(header_t) };
+	request->wire[1] = request->single;
+	request->wires = request->size ? 2 : 1;
+}
+
+MIMPI_Retcode _MIMPI_Send_Prepared(
+	struct MIMPI_Request_Data const *request
+) {
+	/* Channels advance the vector over partial writes, so pass a copy. */
+	struct iovec vector[2] = { request->wire[0], request->wire[1] };
+	_Profile_Sent(request->peer, request->size);
+
+	ssize_t total = sizeof(header_t) + request->size;
+	long begin = _Trace_Begin();
+	MIMPI_Retcode retcode =
+		_MIMPI_Channel_Sendv(request->peer, vector, request->wires) == total ?
+		MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+	_Trace_Sent(request->peer, request->tag, request->size, begin);
+
+	return retcode;
+}
+
+/* Rendezvous control message, followed by the payload if data is given. */
+MIMPI_Retcode _MIMPI_Send_Rendezvous(
+	int type,
+	int tag,
+	int context,
+	size_t size,
+	unsigned long handle,
+	struct iovec const *data,
+	int data_count,
+	int destination
+) {
+	rendezvous_t rendezvous;
+	memset(&rendezvous, 0, sizeof(rendezvous_t));
+	rendezvous.header.size = size;
+	rendezvous.header.tag = tag;
+	rendezvous.header.context = context;
+	rendezvous.handle = handle;
+
+	return _MIMPI_Send_Data(type, 0, &rendezvous, sizeof(rendezvous_t), data,
+		data_count, destination);
+}
+
+/*** Senders *****************************************************************/
+
+void Sender_Init(
+	struct Sender *sender,
+	int rank
+) {
+	sender->rank = rank;
+	sender->front = NULL;
+	sender->back = NULL;
+	sender->announced = NULL;
+	sender->handles = 0;
+	sender->batch = NULL;
+	sender->batched = 0;
+	sender->batch_since = 0;
+	sender->batch_retcode = MIMPI_SUCCESS;
+	sender->batch_listed = false;
+	sender->running = false;
+	sender->busy = false;
+	sender->closing = false;
+	sender->failed = false;
+	ASSERT_ZERO(pthread_mutex_init(&sender->lock, NULL));
+	ASSERT_ZERO(pthread_cond_init(&sender->changed, NULL));
+}
+
+/* Must be called with sender lock held. */
+void _Sender_Push(
+	struct Sender *sender,
+	struct MIMPI_Request_Data *request
+) {
+	request->next = NULL;
+	if (sender->back) sender->back->next = request;
+	else sender->front = request;
+	sender->back = request;
+}
+
+/* Must be called with sender lock held. */
+bool _Sender_Unannounce(
+	struct Sender *sender,
+	struct MIMPI_Request_Data *request
+) {
+	struct MIMPI_Request_Data **current = &sender->announced;
+	while (*current && *current != request) current = &(*current)->next;
+
+	bool found = *current != NULL;
+	if (found) *current = request->next;
+
+	return found;
+}
+
+MIMPI_Retcode _Sender_Transmit(
+	struct Sender *sender,
+	struct MIMPI_Request_Data *request,
+	bool announce
+) {
+	if (request->type == REQUEST_CLEAR)
+		return _MIMPI_Send_Rendezvous(MIMPI_CLEAR_TAG, 0, 0, 0,
+			request->handle, NULL, 0, sender->rank);
+
+	if (!request->rendezvous && request->persistent)
+		return _MIMPI_Send_Prepared(request);
+
+	if (!request->rendezvous)
+		return _MIMPI_Send_Data(request->tag, request->context, NULL, 0,
+			request->vector, request->vectors, sender->rank);
+
+	if (announce)
+		return _MIMPI_Send_Rendezvous(MIMPI_RENDEZVOUS_TAG, request->tag,
+			request->context, request->size, request->handle, NULL, 0,
+			sender->rank);
+
+	/* Payload is only sent once the destination has cleared it. */
+	return _MIMPI_Send_Rendezvous(MIMPI_PAYLOAD_TAG, request->tag,
+		request->context, request->size, request->handle, request->vector,
+		request->vectors, sender->rank);
+}
+
+void *Sender_Main(
+	void *raw_sender
+) {
+	struct Sender *sender = (struct Sender*)raw_sender;
+
+	_Affinity_Helper();
+	_Trace_Name("sender", sender->rank);
+
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	while (true) {
+		while (!sender->front && !sender->closing)
+			ASSERT_ZERO(pthread_cond_wait(&sender->changed, &sender->lock));
+
+		if (!sender->front) break;
+
+		struct MIMPI_Request_Data *request = sender->front;
+		sender->front = request->next;
+		if (!sender->front) sender->back = NULL;
+		sender->busy = true;
+
+		/* Listed before the announcement goes out, as clearing may follow. */
+		bool announce = request->rendezvous && !request->announced;
+		if (announce) {
+			request->announced = true;
+			request->handle = sender->handles++;
+			request->next = sender->announced;
+			sender->announced = request;
+		}
+
+		MIMPI_Retcode retcode = sender->failed ?
+			MIMPI_ERROR_REMOTE_FINISHED : MIMPI_SUCCESS;
+
+		ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+
+		if (retcode == MIMPI_SUCCESS || !announce)
+			retcode = _Sender_Transmit(sender, request, announce);
+
+		ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+		sender->busy = false;
+
+		if (request->type == REQUEST_CLEAR) {
+			free(request);
+		} else if (!announce || (retcode != MIMPI_SUCCESS &&
+			_Sender_Unannounce(sender, request))) {
+			request->retcode = retcode;
+			request->complete = true;
+		}
+
+		ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+	}
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+
+	return NULL;
+}
+
+/* Lets the sender thread finish the queue and stops it. */
+void Sender_Stop(
+	struct Sender *sender
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+	bool running = sender->running;
+	sender->closing = true;
+	ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+
+	if (running) {
+		ASSERT_ZERO(pthread_join(sender->thread, NULL));
+		sender->running = false;
+	}
+}
+
+void Sender_Destroy(
+	struct Sender *sender
+) {
+	free(sender->batch);
+	ASSERT_ZERO(pthread_cond_destroy(&sender->changed));
+	ASSERT_ZERO(pthread_mutex_destroy(&sender->lock));
+}
+
+void Sender_Enqueue(
+	struct Sender *sender,
+	struct MIMPI_Request_Data *request
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	if (!sender->running) {
+		ASSERT_ZERO(pthread_create(&sender->thread, NULL, Sender_Main,
+			sender));
+		sender->running = true;
+	}
+
+	_Sender_Push(sender, request);
+
+	ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+}
+
+/* Queues clearing of a message the peer announced with given handle. */
+void Sender_Clear(
+	struct Sender *sender,
+	unsigned long handle
+) {
+	struct MIMPI_Request_Data *request =
+		(struct MIMPI_Request_Data*)malloc(sizeof(struct MIMPI_Request_Data));
+	ASSERT_NOT_NULL(request);
+
+	request->type = REQUEST_CLEAR;
+	request->handle = handle;
+	request->rendezvous = false;
+	request->announced = false;
+	request->complete = false;
+
+	Sender_Enqueue(sender, request);
+}
+
+/* Queues the payload of an announced message the peer has cleared. */
+void Sender_Cleared(
+	struct Sender *sender,
+	unsigned long handle
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	struct MIMPI_Request_Data *request = sender->announced;
+	while (request && request->handle != handle) request = request->next;
+
+	if (request) {
+		_Sender_Unannounce(sender, request);
+		_Sender_Push(sender, request);
+		ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+	}
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+}
+
+/* Fails announced messages once the peer cannot clear them anymore. */
+void Sender_Fail(
+	struct Sender *sender
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	sender->failed = true;
+
+	while (sender->announced) {
+		struct MIMPI_Request_Data *request = sender->announced;
+		sender->announced = request->next;
+		request->retcode = MIMPI_ERROR_REMOTE_FINISHED;
+		request->complete = true;
+	}
+
+	ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+}
+
+/* Takes the channel from the sender thread once all queued sends went out. */
+void Sender_Acquire(
+	struct Sender *sender
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	while (sender->front || sender->busy)
+		ASSERT_ZERO(pthread_cond_wait(&sender->changed, &sender->lock));
+	sender->busy = true;
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+}
+
+/* Takes the channel only if no sends are queued or going out. */
+bool Sender_Try_Acquire(
+	struct Sender *sender
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	bool idle = !sender->front && !sender->busy;
+	if (idle) sender->busy = true;
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+
+	return idle;
+}
+
+void Sender_Release(
+	struct Sender *sender
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	sender->busy = false;
+	ASSERT_ZERO(pthread_cond_broadcast(&sender->changed));
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+}
+
+bool Sender_Wait(
+	struct Sender *sender,
+	struct MIMPI_Request_Data *request,
+	bool block
+) {
+	ASSERT_ZERO(pthread_mutex_lock(&sender->lock));
+
+	while (block && !request->complete)
+		ASSERT_ZERO(pthread_cond_wait(&sender->changed, &sender->lock));
+	bool complete = request->complete;
+
+	ASSERT_ZERO(pthread_mutex_unlock(&sender->lock));
+
+	return complete;
+}
+
+/*** Batching ****************************************************************/
+
+/*
+    MIMPI_BATCH_SIZE gathers small user messages to each destination in a
+    buffer of that many bytes, in their wire format. A batch is written out
+    once the next message does not fit, once it has been open for
+    MIMPI_BATCH_DELAY nanoseconds when a message is added, before anything
+    else is sent to its destination, before this rank waits for anything,
+    or in MIMPI_Flush.
+*/
+void _Batch_Init(void) {
+	char *size = getenv("MIMPI_BATCH_SIZE");
+	if (size) MIMPI_batch_size = strtoull(size, NULL, 10);
+
+	char *delay = getenv("MIMPI_BATCH_DELAY");
+	if (delay) MIMPI_batch_delay = strtol(delay, NULL, 10);
+
+	if (MIMPI_batch_size) {
+		MIMPI_batched = (int*)malloc(MIMPI_World_size() * sizeof(int));
+		ASSERT_NOT_NULL(MIMPI_batched);
+	}
+}
+
+/* Must be called with the channel of the sender acquired. */
+void _Batch_Write(
+	struct Sender *sender
+) {
+	if (!sender->batched) return;
+
+	struct iovec vector = { sender->batch, sender->batched };
+	long begin = _Trace_Begin();
+
+	if (_MIMPI_Channel_Sendv(sender->rank, &vector, 1) !=
+		(ssize_t)sender->batched)
+		sender->batch_retcode = MIMPI_ERROR_REMOTE_FINISHED;
+
+	for (size_t offset = 0; begin && offset < sender->batched;) {
+		header_t header;
+		memcpy(&header, sender->batch + offset, sizeof(header_t));
+		_Trace_Sent(sender->rank, header.tag, header.size, begin);
+		offset += sizeof(header_t) + header.size;
+	}
+
+	sender->batched = 0;
+}
+
+void Batch_Flush(
+	struct Sender *sender
+) {
+	if (!sender->batched) return;
+
+	Sender_Acquire(sender);
+	_Batch_Write(sender);
+	Sender_Release(sender);
+}
+
+void Batch_Flush_All(void) {
+	while (MIMPI_batched_count > 0) {
+		struct Sender *sender =
+			&MIMPI_senders[MIMPI_batched[--MIMPI_batched_count]];
+
+		sender->batch_listed = false;
+		Batch_Flush(sender);
+	}
+}
+
+/* Appends a message to the batch of its destination, if it is eligible. */
+bool Batch_Add(
+	struct Sender *sender,
+	struct iovec const *vector,
+	int vectors,
+	size_t size,
+	int tag,
+	int context
+) {
+	if (!MIMPI_batch_size || tag < 0 ||
+		sizeof(header_t) + size > MIMPI_batch_size)
+		return false;
+
+	if (!sender->batch) {
+		sender->batch = (char*)malloc(MIMPI_batch_size);
+		ASSERT_NOT_NULL(sender->batch);
+	}
+
+	if (sender->batched + sizeof(header_t) + size > MIMPI_batch_size)
+		Batch_Flush(sender);
+
+	long now = _MIMPI_Clock();
+	if (!sender->batched) sender->batch_since = now;
+
+	header_t header;
+	memset(&header, 0, sizeof(header_t));
+	header.size = size;
+	header.tag = tag;
+	header.context = context;
+
+	memcpy(sender->batch + sender->batched, &header, sizeof(header_t));
+	sender->batched += sizeof(header_t);
+
+	for (int i = 0; i < vectors; i++) {
+		memcpy(sender->batch + sender->batched, vector[i].iov_base,
+			vector[i].iov_len);
+		sender->batched += vector[i].iov_len;
+	}
+
+	if (!sender->batch_listed) {
+		MIMPI_batched[MIMPI_batched_count++] = sender->rank;
+		sender->batch_listed = true;
+	}
+
+	_Profile_Sent(sender->rank, size);
+
+	if (now - sender->batch_since >= MIMPI_batch_delay)
+		Batch_Flush(sender);
+
+	return true;
+}
+
+/*** Receiver ****************************************************************/
+
+bool _Receiver_Receive_Data(
+	int source,
+	void *data,
+	size_t size
+) {
+	return !size || _MIMPI_Channel_Recv(source, data, size) > 0;
+}
+
+/* Reads the fixed part of a control message of given size. */
+bool _Receiver_Receive_Control(
+	int source,
+	void *body,
+	size_t count,
+	size_t size
+) {
+	if (size < count)
+		fatal("Malformed control message from rank %d", source);
+
+	return _MIMPI_Channel_Recv(source, body, count) > 0;
+}
+
+/* Reads a cleared payload straight into the receive it was cleared for. */
+bool _Receiver_Receive_Payload(
+	struct Inbox *inbox,
+	rendezvous_t const *rendezvous
+) {
+	struct Inbox_Post *post = Inbox_Take_Cleared(inbox, rendezvous->handle);
+
+	if (!post)
+		fatal("Payload of rank %d was never cleared", inbox->rank);
+
+	bool result = _Receiver_Receive_Data(inbox->rank, post->data,
+		rendezvous->header.size);
+	post->retcode = result ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+
+	Inbox_Deliver(inbox, post);
+
+	return result;
+}
+
+/* Handles a message whose header has been read. */
+bool _Receiver_Dispatch(
+	struct Inbox *inbox,
+	header_t const *header
+) {
+	int source = inbox->rank;
+	int tag = header->tag;
+	size_t size = header->size;
+
+	/* Tells how many collectives a peer on another host joined. */
+	if (tag == MIMPI_CLOSE_TAG) {
+		_Receiver_Receive_Control(source, &inbox->collectives,
+			sizeof(unsigned long), size);
+		return false;
+	}
+
+	if (tag == MIMPI_PROBE_TAG || tag == MIMPI_DEADLOCK_TAG) {
+		probe_t probe;
+		if (!_Receiver_Receive_Control(source, &probe, sizeof(probe_t), size))
+			return false;
+
+		if (tag == MIMPI_PROBE_TAG) Inbox_Probe(inbox, &probe);
+		else Inbox_Deadlock(inbox, probe.wait);
+		return true;
+	}
+
+	rendezvous_t rendezvous;
+
+	if (tag == MIMPI_RENDEZVOUS_TAG || tag == MIMPI_CLEAR_TAG ||
+		tag == MIMPI_PAYLOAD_TAG) {
+		if (!_Receiver_Receive_Control(source, &rendezvous,
+			sizeof(rendezvous_t), size))
+			return false;
+	}
+
+	if (tag == MIMPI_RENDEZVOUS_TAG) {
+		if (Inbox_Announce(inbox, rendezvous.header.tag,
+			rendezvous.header.context, rendezvous.header.size,
+			rendezvous.handle))
+			Sender_Clear(&MIMPI_senders[source], rendezvous.handle);
+		return true;
+	}
+
+	if (tag == MIMPI_CLEAR_TAG) {
+		Sender_Cleared(&MIMPI_senders[source], rendezvous.handle);
+		return true;
+	}
+
+	if (tag == MIMPI_PAYLOAD_TAG)
+		return _Receiver_Receive_Payload(inbox, &rendezvous);
+
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+
+	struct Inbox_Post *post = Inbox_Take_Post(inbox, tag, header->context,
+		size);
+
+	if (post) {
+		ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+		bool result = _Receiver_Receive_Data(source, post->data, size);
+		post->retcode = result ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+
+		Inbox_Deliver(inbox, post);
+
+		return result;
+	}
+
+	/* Unexpected message, receives posted meanwhile attach to it. */
+	struct Inbox_Message *message = Inbox_Save_Pending(inbox, tag,
+		header->context, size);
+
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	bool result = _Receiver_Receive_Data(source, message->data, size);
+
+	ASSERT_ZERO(pthread_mutex_lock(&inbox->lock));
+	Inbox_Complete_Pending(inbox, message, result);
+	ASSERT_ZERO(pthread_mutex_unlock(&inbox->lock));
+
+	return result;
+}
+
+bool _Receiver_Receive(
+	struct Inbox *inbox
+) {
+	int source = inbox->rank;
+	header_t header;
+
+	if (_MIMPI_Channel_Recv(source, &header, sizeof(header_t)) <= 0)
+		return false;
+
+	_Profile_Received(source, header.size);
+
+	long begin = _Trace_Begin();
+	bool result = _Receiver_Dispatch(inbox, &header);
+	_Trace_Received(source, header.tag, header.size, begin);
+
+	return result;
+}
+
+void _Receiver_Finish(
+	struct Inbox *inbox
+) {
+	ASSERT_SYS_OK(close(MIMPI_readers[inbox->rank]));
+
+	Inbox_Close(inbox);
+	Sender_Fail(&MIMPI_senders[inbox->rank]);
+}
+
+void *Receiver_Main(
+	void* raw_inbox
+) {
+	struct Inbox* inbox = (struct Inbox*)raw_inbox;
+
+	_Affinity_Helper();
+	_Trace_Name("receiver", inbox->rank);
+
+	while (_Receiver_Receive(inbox));
+
+	_Receiver_Finish(inbox);
+
+	return NULL;
+}
+
+/* Takes over a channel handed over to us, returns its source or -1. */
+int _Receiver_Accept(
+	int listener
+) {
+	int source, fds[MIMPI_HANDSHAKE_FDS];
+	int count = listener == MIMPI_LISTEN_FD ?
+		_Channel_Accept(&source, fds) : _Tcp_Accept(&source, fds);
+
+	if (source < 0 || source >= MIMPI_World_size() ||
+		source == MIMPI_World_rank())
+		fatal("Channel handshake from invalid rank %d", source);
+
+	if (!count) {
+		Inbox_Close(&MIMPI_inboxes[source]);
+		Sender_Fail(&MIMPI_senders[source]);
+		return -1;
+	}
+
+	bool ring = MIMPI_transports[source] == &MIMPI_ring_transport;
+	if (count != (ring ? 2 : 1))
+		fatal("Channel handshake from rank %d without its ring", source);
+
+	MIMPI_readers[source] = fds[0];
+	if (ring) {
+		MIMPI_in_rings[source] = _Ring_Map(fds[1]);
+	} else {
+		MIMPI_read_buffers[source] =
+			(struct Channel_Buffer*)malloc(sizeof(struct Channel_Buffer));
+		ASSERT_NOT_NULL(MIMPI_read_buffers[source]);
+		MIMPI_read_buffers[source]->begin = 0;
+		MIMPI_read_buffers[source]->end = 0;
+	}
+
+	return source;
+}
+
+/* Waits for a handshake on either listener, returning the one it came to. */
+int _Receiver_Listener(void) {
+	if (MIMPI_tcp_listener == -1)
+		return MIMPI_LISTEN_FD;
+
+	struct pollfd listeners[2] = {
+		{ .fd = MIMPI_LISTEN_FD, .events = POLLIN },
+		{ .fd = MIMPI_tcp_listener, .events = POLLIN }
+	};
+
+	while (poll(listeners, 2, -1) == -1)
+		if (errno != EINTR) syserr("poll on listeners failed");
+
+	return listeners[0].revents ? MIMPI_LISTEN_FD : MIMPI_tcp_listener;
+}
+
+void _Receiver_Stop_Listening(void) {
+	ASSERT_SYS_OK(close(MIMPI_LISTEN_FD));
+
+	if (MIMPI_tcp_listener != -1) {
+		ASSERT_SYS_OK(close(MIMPI_tcp_listener));
+		MIMPI_tcp_listener = -1;
+	}
+}
+
+/* Starts a receiver for every peer once it opens its channel to us. */
+void *Acceptor_Main(
+	void *unused
+) {
+	(void)unused;
+
+	_Affinity_Helper();
+
+	for (int peers = 1; peers < MIMPI_World_size(); peers++) {
+		int source = _Receiver_Accept(_Receiver_Listener());
+		if (source == -1) continue;
+
+		ASSERT_ZERO(pthread_create(&MIMPI_receivers[source],
+			NULL, Receiver_Main,
+			(struct Inbox*)&MIMPI_inboxes[source]));
+	}
+
+	_Receiver_Stop_Listening();
+
+	return NULL;
+}
+
+/*** Progress engine *********************************************************/
+
+/*
+    Receives everything queued in the ring of given inbox, then asks the
+    writer for a wake-up token. Returns false once the channel is closed.
+*/
+bool _Engine_Drain(
+	struct Inbox *inbox,
+	bool closed
+) {
+	struct MIMPI_Ring *ring = MIMPI_in_rings[inbox->rank];
+
+	while (true) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		if (atomic_load(&ring->head) == tail) {
+			if (closed) return false;
+
+			atomic_store(&ring->reader_waiting, 1);
+			if (atomic_load(&ring->head) == tail) return true;
+			atomic_exchange(&ring->reader_waiting, 0);
+		}
+
+		if (!_Receiver_Receive(inbox)) return false;
+	}
+}
+
+/* Handles readiness of the channel, returns false once it is closed. */
+bool _Engine_Progress(
+	struct Inbox *inbox
+) {
+	/* Channel is readable, so none of these blocks for long. */
+	if (!MIMPI_in_rings[inbox->rank]) {
+		do {
+			if (!_Receiver_Receive(inbox)) return false;
+		} while (_MIMPI_Channel_Buffered(inbox->rank));
+
+		return true;
+	}
+
+	char tokens[64];
+	bool closed = chrecv(MIMPI_readers[inbox->rank], tokens,
+		sizeof(tokens)) <= 0;
+	atomic_exchange(&MIMPI_in_rings[inbox->rank]->reader_waiting, 0);
+
+	return _Engine_Drain(inbox, closed);
+}
+
+void _Engine_Watch(
+	int epoll,
+	int fd,
+	int key
+) {
+	struct epoll_event event = { .events = EPOLLIN, .data.u32 = key };
+	ASSERT_SYS_OK(epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event));
+}
+
+/* Single thread multiplexing the listener and all channels with epoll. */
+void *Engine_Main(
+	void *unused
+) {
+	(void)unused;
+
+	int size = MIMPI_World_size();
+	int handshakes = 1;
+	int open = 0;
+
+	_Affinity_Helper();
+	_Trace_Name("engine", -1);
+
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	ASSERT_SYS_OK(epoll);
+
+	/* Listeners go by keys from the world size on, channels by source. */
+	if (size > 1) {
+		_Engine_Watch(epoll, MIMPI_LISTEN_FD, size);
+		if (MIMPI_tcp_listener != -1)
+			_Engine_Watch(epoll, MIMPI_tcp_listener, size + 1);
+	} else {
+		_Receiver_Stop_Listening();
+	}
+
+	while (handshakes < size || open > 0) {
+		struct epoll_event events[MIMPI_ENGINE_EVENTS];
+		int count = epoll_wait(epoll, events, MIMPI_ENGINE_EVENTS, -1);
+
+		if (count == -1 && errno == EINTR) continue;
+		ASSERT_SYS_OK(count);
+
+		for (int i = 0; i < count; i++) {
+			int source = events[i].data.u32;
+
+			if (source >= size) {
+				source = _Receiver_Accept(source == size ?
+					MIMPI_LISTEN_FD : MIMPI_tcp_listener);
+
+				if (++handshakes == size)
+					_Receiver_Stop_Listening();
+
+				if (source == -1) continue;
+
+				_Engine_Watch(epoll, MIMPI_readers[source], source);
+				open++;
+
+				/* Writer may have filled the ring before we took it over. */
+				if (!MIMPI_in_rings[source] ||
+					_Engine_Drain(&MIMPI_inboxes[source], false))
+					continue;
+			} else if (_Engine_Progress(&MIMPI_inboxes[source])) {
+				continue;
+			}
+
+			_Receiver_Finish(&MIMPI_inboxes[source]);
+			open--;
+		}
+	}
+
+	ASSERT_SYS_OK(close(epoll));
+
+	return NULL;
+}
+
+/* MIMPI_PROGRESS selects receiver threads per peer or a single engine. */
+void _Engine_Init(void) {
+	char *progress = getenv("MIMPI_PROGRESS");
+
+	if (!progress || strcmp(progress, "threads") == 0)
+		MIMPI_progress_engine = false;
+	else if (strcmp(progress, "engine") == 0)
+		MIMPI_progress_engine = true;
+	else
+		fatal("Invalid MIMPI_PROGRESS=%s, expected threads or engine",
+			progress);
+}
+
+/*** Deadlock detection ******************************************************/
+
+/*
+    A receive blocked for MIMPI_DEADLOCK_TIMEOUT nanoseconds probes its
+    peer, acknowledging the latest probe seen from it. Probes follow all
+    earlier sends on the channel, so a probe acknowledging our current wait
+    proves the peer got everything we sent and still waits for us.
+*/
+void _Deadlock_Init(void) {
+	char *timeout = getenv("MIMPI_DEADLOCK_TIMEOUT");
+	if (timeout) MIMPI_deadlock_timeout = strtol(timeout, NULL, 10);
+}
+
+MIMPI_Retcode _Deadlock_Send(
+	int tag,
+	unsigned long wait,
+	unsigned long ack,
+	int destination
+) {
+	probe_t probe;
+	memset(&probe, 0, sizeof(probe_t));
+	probe.wait = wait;
+	probe.ack = ack;
+
+	Sender_Acquire(&MIMPI_senders[destination]);
+	_Batch_Write(&MIMPI_senders[destination]);
+	MIMPI_Retcode retcode = _MIMPI_Send_Data(tag, 0, &probe,
+		sizeof(probe_t), NULL, 0, destination);
+	Sender_Release(&MIMPI_senders[destination]);
+
+	return retcode;
+}
+
+/* Waits for the post, failing it once the peer is found waiting for us. */
+void _Deadlock_Wait(
+	int source,
+	struct Inbox_Post *post
+) {
+	struct Inbox *inbox = &MIMPI_inboxes[source];
+
+	struct Inbox_Detection detection;
+	memset(&detection, 0, sizeof(struct Inbox_Detection));
+	detection.wait = ++inbox->waits;
+
+	ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &detection.deadline));
+	long deadline = detection.deadline.tv_nsec + MIMPI_deadlock_timeout;
+	detection.deadline.tv_sec += deadline / 1000000000l;
+	detection.deadline.tv_nsec = deadline % 1000000000l;
+
+	while (Inbox_Wait(inbox, post, true, &detection)) {
+		if (detection.ack != detection.wait) {
+			_Deadlock_Send(MIMPI_PROBE_TAG, detection.wait, detection.probe,
+				source);
+			continue;
+		}
+
+		_Deadlock_Send(MIMPI_DEADLOCK_TAG, detection.probe, 0, source);
+		Inbox_Fail(inbox, post, MIMPI_ERROR_DEADLOCK_DETECTED);
+	}
+}
+
+/*** Point-to-point communication ********************************************/
+
+MIMPI_Retcode _MIMPI_Check_Peer(
+	int peer
+) {
+	if (peer == MIMPI_World_rank())
+		return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+
+	if (peer < 0 || peer >= MIMPI_World_size())
+		return MIMPI_ERROR_NO_SUCH_RANK;
+
+	return MIMPI_SUCCESS;
+}
+
+/*
+    MIMPI_RENDEZVOUS_THRESHOLD makes user messages larger than that many
+    bytes wait at the sender until the destination posts a matching receive.
+    Internal messages of collectives are always sent eagerly.
+*/
+void _MIMPI_Rendezvous_Init(void) {
+	char *threshold = getenv("MIMPI_RENDEZVOUS_THRESHOLD");
+	if (threshold) MIMPI_rendezvous_threshold = strtoull(threshold, NULL, 10);
+}
+
+bool _MIMPI_Rendezvous(
+	size_t count,
+	int tag
+) {
+	return tag >= 0 && count > MIMPI_rendezvous_threshold;
+}
+
+struct MIMPI_Request_Data *_MIMPI_Request_New(
+	Request_Type type,
+	void const *data,
+	size_t count,
+	int peer,
+	int tag,
+	int context
+) {
+	struct MIMPI_Request_Data *request =
+		(struct MIMPI_Request_Data*)malloc(sizeof(struct MIMPI_Request_Data));
+	ASSERT_NOT_NULL(request);
+
+	request->type = type;
+	request->next = NULL;
+	request->peer = peer;
+	request->tag = tag;
+	request->context = context;
+	request->size = count;
+	request->data = data;
+	request->single = (struct iovec){ (void*)data, count };
+	request->vector = &request->single;
+	request->vectors = 1;
+	request->retcode = MIMPI_SUCCESS;
+	request->rendezvous = type == REQUEST_SEND && _MIMPI_Rendezvous(count, tag);
+	request->announced = false;
+	request->complete = false;
+	request->persistent = false;
+	request->active = true;
+
+	request->post.next = NULL;
+	request->post.tag = tag;
+	request->post.context = context;
+	request->post.size = count;
+	request->post.data = (void*)data;
+	request->post.retcode = MIMPI_SUCCESS;
+	request->post.delivered = false;
+	request->post.indexed = false;
+
+	return request;
+}
+
+MIMPI_Retcode _MIMPI_Sendv(
+	struct iovec const *vector,
+	int vectors,
+	int destination,
+	int tag,
+	int context
+) {
+	MIMPI_Retcode retcode = _MIMPI_Check_Peer(destination);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	struct Sender *sender = &MIMPI_senders[destination];
+	size_t count = _MIMPI_Vector_Size(vector, vectors);
+
+	if (Batch_Add(sender, vector, vectors, count, tag, context))
+		return MIMPI_SUCCESS;
+
+	/* Announced messages are handled by the sender thread throughout. */
+	if (_MIMPI_Rendezvous(count, tag)) {
+		struct MIMPI_Request_Data *request = _MIMPI_Request_New(REQUEST_SEND,
+			NULL, count, destination, tag, context);
+		request->vector = vector;
+		request->vectors = vectors;
+
+		Batch_Flush(sender);
+		Sender_Enqueue(sender, request);
+		Batch_Flush_All();
+		Sender_Wait(sender, request, true);
+
+		retcode = request->retcode;
+		free(request);
+
+		return retcode;
+	}
+
+	Sender_Acquire(sender);
+	_Batch_Write(sender);
+	retcode = _MIMPI_Send_Data(tag, context, NULL, 0, vector, vectors,
+		destination);
+	Sender_Release(sender);
+
+	return retcode;
+}
+
+MIMPI_Retcode _MIMPI_Send(
+	void const *data,
+	size_t count,
+	int destination,
+	int tag,
+	int context
+) {
+	struct iovec vector = { (void*)data, count };
+
+	return _MIMPI_Sendv(&vector, 1, destination, tag, context);
+}
+
+/* Posts a receive, clearing the announced message it may have matched. */
+void _MIMPI_Post(
+	int source,
+	struct Inbox_Post *post
+) {
+	unsigned long handle;
+
+	if (Inbox_Match_Or_Post(&MIMPI_inboxes[source], post, &handle))
+		Sender_Clear(&MIMPI_senders[source], handle);
+}
+
+void _MIMPI_Recv_Post(
+	int source,
+	struct Inbox_Post *post,
+	bool detect
+) {
+	Batch_Flush_All();
+	_MIMPI_Post(source, post);
+	if (detect) _Deadlock_Wait(source, post);
+	else Inbox_Wait(&MIMPI_inboxes[source], post, true, NULL);
+}
+
+MIMPI_Retcode _MIMPI_Recv(
+	void *data,
+	size_t count,
+	int source,
+	int tag,
+	int context,
+	bool detect
+) {
+	struct Inbox_Post post = {
+		.next = NULL,
+		.tag = tag,
+		.context = context,
+		.size = count,
+		.data = data,
+		.retcode = MIMPI_SUCCESS,
+		.delivered = false
+	};
+
+	_MIMPI_Recv_Post(source, &post, detect);
+
+	return post.retcode;
+}
+
+/*
+    Scans the inboxes round-robin, starting after the last source matched,
+    so that a busy peer cannot starve the others. When nothing matches, it
+    sleeps until a receiver thread brings in a new message. Returns the
+    source matched, or -1 once every peer has finished.
+*/
+int _MIMPI_Recv_Any(
+	struct Inbox_Post *post
+) {
+	int rank = MIMPI_World_rank();
+	int size = MIMPI_World_size();
+
+	Batch_Flush_All();
+
+	while (true) {
+		unsigned int arrivals = atomic_load(&MIMPI_arrivals);
+		bool open = false;
+
+		for (int i = 0; i < size; i++) {
+			int source = (MIMPI_any_next + i) % size;
+			if (source == rank) continue;
+
+			struct Inbox *inbox = &MIMPI_inboxes[source];
+			unsigned long handle;
+			bool closed;
+
+			Inbox_Match_Result result = Inbox_Try_Match(inbox, post, &handle,
+				&closed);
+
+			if (result == INBOX_MISSED) {
+				open = open || !closed;
+				continue;
+			}
+
+			if (result == INBOX_CLEARED)
+				Sender_Clear(&MIMPI_senders[source], handle);
+
+			Inbox_Wait(inbox, post, true, NULL);
+			MIMPI_any_next = (source + 1) % size;
+
+			return source;
+		}
+
+		if (!open) return -1;
+
+		Inbox_Await_Arrival(arrivals);
+	}
+}
+
+bool _MIMPI_Request_Progress(
+	struct MIMPI_Request_Data *request,
+	bool block
+) {
+	if (request->complete) return true;
+
+	Batch_Flush_All();
+
+	if (request->type == REQUEST_SEND)
+		return Sender_Wait(&MIMPI_senders[request->peer], request, block);
+
+	Inbox_Wait(&MIMPI_inboxes[request->peer], &request->post, block, NULL);
+
+	if (!request->post.delivered) return false;
+
+	request->retcode = request->post.retcode;
+	request->complete = true;
+
+	return true;
+}
+
+/*
+    Writes an eager persistent send right away, as _MIMPI_Sendv would, when
+    nothing else is queued for its destination. Returns whether it did.
+*/
+bool _MIMPI_Request_Send_Now(
+	struct MIMPI_Request_Data *request
+) {
+	struct Sender *sender = &MIMPI_senders[request->peer];
+
+	if (!request->persistent || request->rendezvous)
+		return false;
+
+	if (Batch_Add(sender, request->vector, request->vectors, request->size,
+		request->tag, request->context)) {
+		request->complete = true;
+		return true;
+	}
+
+	if (!Sender_Try_Acquire(sender))
+		return false;
+
+	_Batch_Write(sender);
+	request->retcode = _MIMPI_Send_Prepared(request);
+	request->complete = true;
+	Sender_Release(sender);
+
+	return true;
+}
+
+/* Hands the request to its sender thread or posts its receive. */
+void _MIMPI_Request_Start(
+	struct MIMPI_Request_Data *request
+) {
+	if (request->type == REQUEST_RECV) {
+		_MIMPI_Post(request->peer, &request->post);
+		return;
+	}
+
+	if (_MIMPI_Request_Send_Now(request))
+		return;
+
+	Batch_Flush(&MIMPI_senders[request->peer]);
+	Sender_Enqueue(&MIMPI_senders[request->peer], request);
+}
+
+/* Only resets what the previous run of a persistent request changed. */
+void _MIMPI_Request_Restart(
+	struct MIMPI_Request_Data *request
+) {
+	request->retcode = MIMPI_SUCCESS;
+	request->announced = false;
+	request->complete = false;
+	request->active = true;
+
+	request->post.next = NULL;
+	request->post.tag = request->tag;
+	request->post.retcode = MIMPI_SUCCESS;
+	request->post.delivered = false;
+
+	_MIMPI_Request_Start(request);
+}
+
+/*** Group communication *****************************************************/
+
+/*
+    Batched messages may be what others wait for before they join. Only
+    collectives of the world are counted in the shared states, ranks of
+    other communicators that finish without joining are only noticed by the
+    ranks that wait for their messages.
+*/
+MIMPI_Retcode _MIMPI_Collective_Begin(
+	struct MIMPI_Comm_Data const *comm
+) {
+	Batch_Flush_All();
+
+	return comm == &MIMPI_world ? _Shm_Collective_Begin() : MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode _MIMPI_Collective_Await(
+	struct MIMPI_Comm_Data const *comm,
+	int rank
+) {
+	return comm == &MIMPI_world ?
+		_Shm_Collective_Await(rank) : MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode _MIMPI_Group_Recv(
+	struct MIMPI_Comm_Data const *comm,
+	void *data,
+	size_t count,
+	int source
+) {
+	return _MIMPI_Recv(data, count, comm->ranks[source], MIMPI_GROUP_TAG,
+		comm->context, false);
+}
+
+/*
+    Messages of collectives carry the status word of the sender after their
+    data. It is sent from a buffer of its own, so data goes out of user
+    memory or wherever it was reduced without being staged first.
+*/
+MIMPI_Retcode _MIMPI_Send_Status(
+	struct MIMPI_Comm_Data const *comm,
+	void const *data,
+	size_t count,
+	MIMPI_Retcode *status,
+	int destination
+) {
+	struct iovec vector[2] = {
+		{ (void*)data, count },
+		{ status, sizeof(MIMPI_Retcode) }
+	};
+
+	MIMPI_Retcode retcode = _MIMPI_Sendv(vector, 2,
+		comm->ranks[destination], MIMPI_GROUP_TAG, comm->context);
+
+	*status = _MIMPI_Update_Retcode(*status, retcode);
+
+	return retcode;
+}
+
+/* Receives data followed by a status word into buffer, merging the status. */
+MIMPI_Retcode _MIMPI_Recv_Status(
+	struct MIMPI_Comm_Data const *comm,
+	uint8_t *buffer,
+	size_t count,
+	MIMPI_Retcode *status,
+	int source
+) {
+	MIMPI_Retcode retcode = _MIMPI_Group_Recv(comm, buffer,
+		count + sizeof(MIMPI_Retcode), source);
+
+	*status = _MIMPI_Update_Retcode(*status, retcode);
+
+	if (retcode == MIMPI_SUCCESS) {
+		MIMPI_Retcode other;
+		memcpy(&other, buffer + count, sizeof(MIMPI_Retcode));
+		*status = _MIMPI_Update_Retcode(*status, other);
+	}
+
+	return retcode;
+}
+
+/*
+    Root reduces straight into recv_data, which may be send_data itself.
+    Other ranks take the first child that arrives as the start of their sum
+    and leaves send their own data, so no rank copies its input.
+*/
+MIMPI_Retcode _MIMPI_Collect(
+	struct MIMPI_Comm_Data const *comm,
+	int parent,
+	int children[MIMPI_CHILDREN],
+	void const *send_data,
+	void *recv_data,
+	size_t elements,
+	MIMPI_Datatype type,
+	MIMPI_Op op
+) {
+	size_t element = _MIMPI_Type_Size(type);
+	size_t count = elements * element;
+	size_t segment = count < MIMPI_SEGMENT_SIZE ? count :
+		MIMPI_SEGMENT_SIZE / element * element;
+	bool leaf = children[0] == -1;
+
+	uint8_t *data = NULL;
+	uint8_t *child_data = NULL;
+
+	if (!leaf) {
+		child_data = (uint8_t*)malloc(segment + sizeof(MIMPI_Retcode));
+		ASSERT_NOT_NULL(child_data);
+	}
+
+	if (!leaf && !recv_data) {
+		data = (uint8_t*)malloc(segment + sizeof(MIMPI_Retcode));
+		ASSERT_NOT_NULL(data);
+	}
+
+	MIMPI_Retcode result = MIMPI_SUCCESS;
+	size_t offset = 0;
+
+	/* Forward each segment up as soon as it is reduced. */
+	do {
+		size_t length = count - offset < segment ? count - offset : segment;
+		uint8_t const *own = (uint8_t const*)send_data + offset;
+		uint8_t *sum = recv_data ? (uint8_t*)recv_data + offset : data;
+		bool summed = recv_data != NULL;
+		MIMPI_Retcode status = result;
+
+		if (recv_data && length && own != sum) memcpy(sum, own, length);
+
+		for (int i = 0; i < MIMPI_CHILDREN; i++) {
+			if (children[i] == -1) continue;
+
+			if (_MIMPI_Recv_Status(comm, summed ? child_data : sum, length,
+				&status, children[i]) != MIMPI_SUCCESS)
+				continue;
+
+			_MIMPI_Reduce(sum, summed ? child_data : own, length / element,
+				type, op);
+			summed = true;
+		}
+
+		if (parent != -1)
+			_MIMPI_Send_Status(comm, summed ? sum : own, length, &status,
+				parent);
+
+		result = status;
+		offset += length;
+	} while (offset < count);
+
+	free(child_data);
+	free(data);
+
+	return result;
+}
+
+/* Root sends straight from recv_data, the others still need the status. */
+MIMPI_Retcode _MIMPI_Distribute(
+	struct MIMPI_Comm_Data const *comm,
+	int parent,
+	int children[MIMPI_CHILDREN],
+	void *recv_data,
+	size_t count,
+	MIMPI_Retcode initial_status
+) {
+	size_t segment = count < MIMPI_SEGMENT_SIZE ? count : MIMPI_SEGMENT_SIZE;
+	uint8_t *data = NULL;
+
+	if (parent != -1) {
+		data = (uint8_t*)malloc(segment + sizeof(MIMPI_Retcode));
+		ASSERT_NOT_NULL(data);
+	}
+
+	MIMPI_Retcode result = initial_status;
+	size_t offset = 0;
+
+	/* Forward each segment down while the next one is still arriving. */
+	do {
+		size_t length = count - offset < segment ? count - offset : segment;
+		uint8_t *own = (uint8_t*)recv_data + offset;
+		MIMPI_Retcode status = result;
+
+		if (parent != -1)
+			_MIMPI_Recv_Status(comm, data, length, &status, parent);
+
+		for (int i = 0; i < MIMPI_CHILDREN; i++) {
+			if (children[i] == -1) continue;
+
+			_MIMPI_Send_Status(comm, parent == -1 ? own : data, length,
+				&status, children[i]);
+		}
+
+		if (parent != -1 && status == MIMPI_SUCCESS && length)
+			memcpy(own, data, length);
+
+		result = _MIMPI_Update_Retcode(result, status);
+		offset += length;
+	} while (offset < count);
+
+	free(data);
+
+	return result;
+}
+
+/*
+    Recursive doubling over the largest power of two ranks. The first
+    2 * (size - power) ranks pair up beforehand, so that even ones hand their
+    data to odd neighbours and only get the final result back.
+*/
+MIMPI_Retcode _MIMPI_Allreduce_Doubling(
+	struct MIMPI_Comm_Data const *comm,
+	void *data,
+	size_t elements,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	size_t count = elements * _MIMPI_Type_Size(type);
+
+	int power = 1;
+	while (power * 2 <= size) power *= 2;
+	int extra = size - power;
+
+	uint8_t *recv_buffer = (uint8_t*)malloc(count + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(recv_buffer);
+
+	int virtual_rank = rank - extra;
+
+	if (rank < 2 * extra) {
+		if (rank % 2 == 0) {
+			_MIMPI_Send_Status(comm, data, count, &status, rank + 1);
+			virtual_rank = -1;
+		} else {
+			if (_MIMPI_Recv_Status(comm, recv_buffer, count, &status,
+				rank - 1) == MIMPI_SUCCESS)
+				_MIMPI_Reduce(data, recv_buffer, elements, type, op);
+			virtual_rank = rank / 2;
+		}
+	}
+
+	if (virtual_rank != -1) {
+		for (int mask = 1; mask < power; mask *= 2) {
+			int partner = virtual_rank ^ mask;
+			partner = partner < extra ? partner * 2 + 1 : partner + extra;
+
+			_MIMPI_Send_Status(comm, data, count, &status, partner);
+			if (_MIMPI_Recv_Status(comm, recv_buffer, count, &status,
+				partner) == MIMPI_SUCCESS)
+				_MIMPI_Reduce(data, recv_buffer, elements, type, op);
+		}
+	}
+
+	if (rank < 2 * extra) {
+		if (rank % 2 == 0) {
+			if (_MIMPI_Recv_Status(comm, recv_buffer, count, &status,
+				rank + 1) == MIMPI_SUCCESS && count)
+				memcpy(data, recv_buffer, count);
+		} else {
+			_MIMPI_Send_Status(comm, data, count, &status, rank - 1);
+		}
+	}
+
+	free(recv_buffer);
+
+	return status;
+}
+
+/*
+    Reduce-scatter followed by allgather around the ring of ranks. Data is
+    split into one chunk per rank; after size - 1 steps each rank holds one
+    fully reduced chunk, and after another size - 1 steps all of them.
+*/
+MIMPI_Retcode _MIMPI_Allreduce_Ring(
+	struct MIMPI_Comm_Data const *comm,
+	void *data,
+	size_t elements,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	int left = (rank + size - 1) % size;
+	int right = (rank + 1) % size;
+	size_t element = _MIMPI_Type_Size(type);
+
+	size_t chunk = (elements + size - 1) / size;
+	size_t chunk_count = chunk * element;
+
+	uint8_t *recv_buffer =
+		(uint8_t*)malloc(chunk_count + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(recv_buffer);
+
+	for (int step = 0; step < 2 * (size - 1); step++) {
+		int send_chunk = (rank - step + 2 * size) % size;
+		int recv_chunk = (rank - step - 1 + 2 * size) % size;
+
+		size_t send_first = send_chunk * chunk;
+		size_t recv_first = recv_chunk * chunk;
+		if (send_first > elements) send_first = elements;
+		if (recv_first > elements) recv_first = elements;
+
+		size_t send_length = elements - send_first < chunk ?
+			elements - send_first : chunk;
+		size_t recv_length = elements - recv_first < chunk ?
+			elements - recv_first : chunk;
+
+		uint8_t *recv_data = (uint8_t*)data + recv_first * element;
+
+		_MIMPI_Send_Status(comm, (uint8_t*)data + send_first * element,
+			send_length * element, &status, right);
+
+		if (_MIMPI_Recv_Status(comm, recv_buffer, recv_length * element,
+			&status, left) != MIMPI_SUCCESS || !recv_length)
+			continue;
+
+		if (step < size - 1)
+			_MIMPI_Reduce(recv_data, recv_buffer, recv_length, type, op);
+		else
+			memcpy(recv_data, recv_buffer, recv_length * element);
+	}
+
+	free(recv_buffer);
+
+	return status;
+}
+
+/*
+    First half of _MIMPI_Allreduce_Ring, shifted by one block so that every
+    rank ends up with its own. A block received is reduced with the input
+    of this rank and passed on to the right in the next step, so only the
+    block in flight needs a buffer.
+*/
+MIMPI_Retcode _MIMPI_Reduce_Scatter_Ring(
+	struct MIMPI_Comm_Data const *comm,
+	void const *send_data,
+	void *recv_data,
+	size_t elements,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	int left = (rank + size - 1) % size;
+	int right = (rank + 1) % size;
+	size_t count = elements * _MIMPI_Type_Size(type);
+	uint8_t const *input = (uint8_t const*)send_data;
+
+	uint8_t *buffer = (uint8_t*)malloc(count + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(buffer);
+	bool received = false;
+
+	for (int step = 0; step < size - 1; step++) {
+		int recv_block = (rank - step - 2 + 2 * size) % size;
+
+		_MIMPI_Send_Status(comm, step ? buffer : input + left * count, count,
+			&status, right);
+
+		received = _MIMPI_Recv_Status(comm, buffer, count, &status, left) ==
+			MIMPI_SUCCESS;
+
+		if (received)
+			_MIMPI_Reduce(buffer, input + recv_block * count, elements, type,
+				op);
+	}
+
+	/* In place, no input is read anymore once the last block is in. */
+	if (received && count) memcpy(recv_data, buffer, count);
+
+	free(buffer);
+
+	return status;
+}
+
+/*
+    In round k every rank signals the rank 2^k places to its right and
+    waits for the one 2^k places to its left. After ceil(log2 size) rounds
+    each rank has heard, directly or not, from all others, and so has the
+    status word of every one of them.
+*/
+MIMPI_Retcode _MIMPI_Barrier_Dissemination(
+	struct MIMPI_Comm_Data const *comm,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	uint8_t buffer[sizeof(MIMPI_Retcode)];
+
+	for (int distance = 1; distance < size; distance *= 2) {
+		_MIMPI_Send_Status(comm, NULL, 0, &status, (rank + distance) % size);
+		_MIMPI_Recv_Status(comm, buffer, 0, &status,
+			(rank - distance + size) % size);
+	}
+
+	return status;
+}
+
+/* Number of ranks in the binomial subtree at index, all following it. */
+int _MIMPI_Subtree(
+	int index,
+	int size
+) {
+	int lowest = index & -index;
+
+	return !index || lowest > size - index ? size - index : lowest;
+}
+
+/*
+    Binomial subtrees span consecutive indices counted from root, so every
+    rank gathers the blocks of its subtree into one buffer, own block first.
+    Children are received smallest first, as the status word following each
+    block lands at the start of the block of the next larger child.
+*/
+MIMPI_Retcode _MIMPI_Gather(
+	struct MIMPI_Comm_Data const *comm,
+	uint8_t *block,
+	size_t count,
+	int root,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	int index = (rank - root + size) % size;
+
+	int parent, children[MIMPI_CHILDREN];
+	_MIMPI_Get_Neighbours(&MIMPI_binomial_topology, &parent, children, rank,
+		root, size);
+
+	for (int i = MIMPI_CHILDREN - 1; i >= 0; i--) {
+		if (children[i] == -1) continue;
+
+		int child = (children[i] - root + size) % size;
+		_MIMPI_Recv_Status(comm, block + (child - index) * count,
+			_MIMPI_Subtree(child, size) * count, &status, children[i]);
+	}
+
+	if (parent != -1)
+		_MIMPI_Send_Status(comm, block, _MIMPI_Subtree(index, size) * count,
+			&status, parent);
+
+	return status;
+}
+
+/* Reverse of _MIMPI_Gather, children are served largest first instead. */
+MIMPI_Retcode _MIMPI_Scatter(
+	struct MIMPI_Comm_Data const *comm,
+	uint8_t *block,
+	size_t count,
+	int root,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	int index = (rank - root + size) % size;
+
 	int parent, children[MIMPI_CHILDREN];
-	_MIMPI_Get_Neighbours(&parent, children, MIMPI_World_rank(), root,
-		MIMPI_World_size());
+	_MIMPI_Get_Neighbours(&MIMPI_binomial_topology, &parent, children, rank,
+		root, size);
+
+	if (parent != -1)
+		_MIMPI_Recv_Status(comm, block, _MIMPI_Subtree(index, size) * count,
+			&status, parent);
+
+	for (int i = 0; i < MIMPI_CHILDREN; i++) {
+		if (children[i] == -1) continue;
+
+		int child = (children[i] - root + size) % size;
+		_MIMPI_Send_Status(comm, block + (child - index) * count,
+			_MIMPI_Subtree(child, size) * count, &status, children[i]);
+	}
+
+	return status;
+}
+
+/*
+    Each rank passes blocks on to its right neighbour, forwarding in every
+    step the one it received in the step before.
+*/
+MIMPI_Retcode _MIMPI_Allgather_Ring(
+	struct MIMPI_Comm_Data const *comm,
+	uint8_t *data,
+	size_t count,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+	int left = (rank + size - 1) % size;
+	int right = (rank + 1) % size;
+
+	uint8_t *recv_buffer = (uint8_t*)malloc(count + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(recv_buffer);
+
+	for (int step = 0; step < size - 1; step++) {
+		int send_block = (rank - step + size) % size;
+		int recv_block = (rank - step - 1 + size) % size;
+
+		_MIMPI_Send_Status(comm, data + send_block * count, count, &status,
+			right);
+
+		if (_MIMPI_Recv_Status(comm, recv_buffer, count, &status, left) ==
+			MIMPI_SUCCESS && count)
+			memcpy(data + recv_block * count, recv_buffer, count);
+	}
+
+	free(recv_buffer);
+
+	return status;
+}
+
+/*
+    In step i every rank sends to the rank i places to its right and
+    receives from the one i places to its left, so each pair of ranks
+    exchanges exactly once and no rank is the target of two sends at a time.
+*/
+MIMPI_Retcode _MIMPI_Alltoall_Pairwise(
+	struct MIMPI_Comm_Data const *comm,
+	uint8_t const *send_data,
+	uint8_t *recv_data,
+	size_t count,
+	MIMPI_Retcode status
+) {
+	int rank = comm->rank;
+	int size = comm->size;
+
+	uint8_t *recv_buffer = (uint8_t*)malloc(count + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(recv_buffer);
+
+	for (int step = 1; step < size; step++) {
+		int destination = (rank + step) % size;
+		int source = (rank - step + size) % size;
+
+		_MIMPI_Send_Status(comm, send_data + destination * count, count,
+			&status, destination);
+
+		if (_MIMPI_Recv_Status(comm, recv_buffer, count, &status, source) ==
+			MIMPI_SUCCESS && count)
+			memcpy(recv_data + source * count, recv_buffer, count);
+	}
+
+	free(recv_buffer);
+
+	return status;
+}
+
+/*** MIMPI interface *********************************************************/
+
+void MIMPI_Init(bool enable_deadlock_detection) {
+	channels_init();
+	_Affinity_Init();
+	_Shm_Init();
+	_Transport_Init();
+	_Topology_Init();
+	_Engine_Init();
+	_MIMPI_Rendezvous_Init();
+	_Batch_Init();
+	_Deadlock_Init();
+	_Spin_Init();
+	_Profile_Init();
+	_Trace_Init();
+
+	MIMPI_deadlock_detection = enable_deadlock_detection;
+
+	MIMPI_inboxes =
+		(struct Inbox*)malloc(MIMPI_World_size() *
+		sizeof(struct Inbox));
+	ASSERT_NOT_NULL(MIMPI_inboxes);
+
+	MIMPI_receivers =
+		(pthread_t*)malloc(MIMPI_World_size() * sizeof(pthread_t));
+	ASSERT_NOT_NULL(MIMPI_receivers);
+
+	MIMPI_senders =
+		(struct Sender*)malloc(MIMPI_World_size() *
+		sizeof(struct Sender));
+	ASSERT_NOT_NULL(MIMPI_senders);
+
+	MIMPI_readers = (int*)malloc(MIMPI_World_size() * sizeof(int));
+	ASSERT_NOT_NULL(MIMPI_readers);
+
+	MIMPI_writers = (int*)malloc(MIMPI_World_size() * sizeof(int));
+	ASSERT_NOT_NULL(MIMPI_writers);
+
+	MIMPI_in_rings = (struct MIMPI_Ring**)calloc(MIMPI_World_size(),
+		sizeof(struct MIMPI_Ring*));
+	ASSERT_NOT_NULL(MIMPI_in_rings);
+
+	MIMPI_out_rings = (struct MIMPI_Ring**)calloc(MIMPI_World_size(),
+		sizeof(struct MIMPI_Ring*));
+	ASSERT_NOT_NULL(MIMPI_out_rings);
+
+	MIMPI_read_buffers = (struct Channel_Buffer**)calloc(MIMPI_World_size(),
+		sizeof(struct Channel_Buffer*));
+	ASSERT_NOT_NULL(MIMPI_read_buffers);
+
+	MIMPI_world.rank = MIMPI_World_rank();
+	MIMPI_world.size = MIMPI_World_size();
+	MIMPI_world.ranks = (int*)malloc(MIMPI_World_size() * sizeof(int));
+	ASSERT_NOT_NULL(MIMPI_world.ranks);
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		MIMPI_world.ranks[rank] = rank;
+		if (rank == MIMPI_World_rank()) continue;
+
+		Inbox_Init(&MIMPI_inboxes[rank], rank);
+		Sender_Init(&MIMPI_senders[rank], rank);
+		MIMPI_readers[rank] = -1;
+		MIMPI_writers[rank] = -1;
+	}
+
+	ASSERT_ZERO(pthread_create(&MIMPI_progress, NULL,
+		MIMPI_progress_engine ? Engine_Main : Acceptor_Main, NULL));
+}
+
+void MIMPI_Finalize() {
+	channels_finalize();
+	Batch_Flush_All();
+	_Shm_Finish();
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		if (rank == MIMPI_World_rank()) continue;
+
+		Sender_Stop(&MIMPI_senders[rank]);
+
+		if (MIMPI_writers[rank] != -1)
+			_MIMPI_Send_Data(MIMPI_CLOSE_TAG, 0, &MIMPI_collectives,
+				sizeof(unsigned long), NULL, 0, rank);
+
+		_Channel_Close(rank);
+	}
+
+	ASSERT_ZERO(pthread_join(MIMPI_progress, NULL));
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		if (rank == MIMPI_World_rank()) continue;
+
+		if (!MIMPI_progress_engine && MIMPI_readers[rank] != -1)
+			ASSERT_ZERO(pthread_join(MIMPI_receivers[rank], NULL));
+		_Ring_Unmap(MIMPI_in_rings[rank]);
+		free(MIMPI_read_buffers[rank]);
+
+		Sender_Destroy(&MIMPI_senders[rank]);
+		Inbox_Destroy(&MIMPI_inboxes[rank]);
+	}
+
+	free(MIMPI_receivers);
+	free(MIMPI_senders);
+	free(MIMPI_readers);
+	free(MIMPI_writers);
+	free(MIMPI_in_rings);
+	free(MIMPI_out_rings);
+	free(MIMPI_read_buffers);
+	free(MIMPI_batched);
+	free(MIMPI_nodes);
+	free(MIMPI_world.ranks);
+	_Transport_Finalize();
+	_Profile_Dump();
+	_Trace_Dump();
+	free(MIMPI_inboxes);
+
+	_Shm_Finalize();
+}
+
+int MIMPI_World_size() {
+	static int mimpi_size = -1;
+	if (mimpi_size == -1)
+		ASSERT_SYS_OK(readenv(&mimpi_size, "MIMPI_SIZE"));
+
+	return mimpi_size;
+}
+
+int MIMPI_World_rank() {
+	static int mimpi_rank = -1;
+	if (mimpi_rank == -1)
+		ASSERT_SYS_OK(readenv(&mimpi_rank, "MIMPI_RANK"));
+
+	return mimpi_rank;
+}
+
+MIMPI_Retcode MIMPI_Send(
+	void const *data,
+	int count,
+	int destination,
+	int tag
+) {
+	long begin = _Profile_Begin();
+	MIMPI_Retcode retcode = _MIMPI_Send(data, count, destination, tag,
+		MIMPI_WORLD_CONTEXT);
+	_Profile_End(PROFILE_SEND, begin, count);
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Sendv(
+	struct iovec const *vector,
+	int count,
+	int destination,
+	int tag
+) {
+	long begin = _Profile_Begin();
+	MIMPI_Retcode retcode = _MIMPI_Sendv(vector, count, destination, tag,
+		MIMPI_WORLD_CONTEXT);
+	_Profile_End(PROFILE_SEND, begin, _MIMPI_Vector_Size(vector, count));
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Flush() {
+	Batch_Flush_All();
+
+	MIMPI_Retcode retcode = MIMPI_SUCCESS;
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		if (rank == MIMPI_World_rank()) continue;
+
+		struct Sender *sender = &MIMPI_senders[rank];
+		retcode = _MIMPI_Update_Retcode(retcode, sender->batch_retcode);
+		sender->batch_retcode = MIMPI_SUCCESS;
+	}
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Recv(
+	void *data,
+	int count,
+	int source,
+	int tag
+) {
+	if (source == MIMPI_World_rank()) {
+		return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+	}
+
+	if (source < 0 || source >= MIMPI_World_size()) {
+		return MIMPI_ERROR_NO_SUCH_RANK;
+	}
+
+	long begin = _Profile_Begin();
+	MIMPI_Retcode retcode = _MIMPI_Recv(data, count, source, tag,
+		MIMPI_WORLD_CONTEXT, MIMPI_deadlock_detection);
+	_Profile_End(PROFILE_RECV, begin, count);
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Recv_From(
+	void *data,
+	int count,
+	int source,
+	int tag,
+	MIMPI_Status *status
+) {
+	if (source != MIMPI_ANY_SOURCE) {
+		MIMPI_Retcode retcode = _MIMPI_Check_Peer(source);
+
+		if (retcode != MIMPI_SUCCESS)
+			return retcode;
+	}
+
+	struct Inbox_Post post = {
+		.next = NULL,
+		.tag = tag,
+		.context = MIMPI_WORLD_CONTEXT,
+		.size = count,
+		.data = data,
+		.retcode = MIMPI_SUCCESS,
+		.delivered = false
+	};
+
+	long begin = _Profile_Begin();
+
+	if (source != MIMPI_ANY_SOURCE)
+		_MIMPI_Recv_Post(source, &post, MIMPI_deadlock_detection);
+	else if ((source = _MIMPI_Recv_Any(&post)) == -1)
+		post.retcode = MIMPI_ERROR_REMOTE_FINISHED;
+
+	_Profile_End(PROFILE_RECV, begin, count);
+
+	if (status) {
+		status->source = source;
+		status->tag = post.tag;
+	}
+
+	return post.retcode;
+}
+
+MIMPI_Retcode MIMPI_Isend(
+	void const *data,
+	int count,
+	int destination,
+	int tag,
+	MIMPI_Request *request
+) {
+	*request = MIMPI_REQUEST_NULL;
+
+	MIMPI_Retcode retcode = _MIMPI_Check_Peer(destination);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	*request = _MIMPI_Request_New(REQUEST_SEND, data, count, destination,
+		tag, MIMPI_WORLD_CONTEXT);
+	_MIMPI_Request_Start(*request);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Irecv(
+	void *data,
+	int count,
+	int source,
+	int tag,
+	MIMPI_Request *request
+) {
+	*request = MIMPI_REQUEST_NULL;
+
+	MIMPI_Retcode retcode = _MIMPI_Check_Peer(source);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	*request = _MIMPI_Request_New(REQUEST_RECV, data, count, source, tag,
+		MIMPI_WORLD_CONTEXT);
+	_MIMPI_Request_Start(*request);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Send_Init(
+	void const *data,
+	int count,
+	int destination,
+	int tag,
+	MIMPI_Request *request
+) {
+	*request = MIMPI_REQUEST_NULL;
+
+	MIMPI_Retcode retcode = _MIMPI_Check_Peer(destination);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	*request = _MIMPI_Request_New(REQUEST_SEND, data, count, destination,
+		tag, MIMPI_WORLD_CONTEXT);
+	(*request)->persistent = true;
+	(*request)->active = false;
+	_MIMPI_Send_Prepare(*request);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Recv_Init(
+	void *data,
+	int count,
+	int source,
+	int tag,
+	MIMPI_Request *request
+) {
+	*request = MIMPI_REQUEST_NULL;
+
+	MIMPI_Retcode retcode = _MIMPI_Check_Peer(source);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	*request = _MIMPI_Request_New(REQUEST_RECV, data, count, source, tag,
+		MIMPI_WORLD_CONTEXT);
+	(*request)->persistent = true;
+	(*request)->active = false;
+	Index_Prepare(&(*request)->post);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Start(MIMPI_Request *request) {
+	if (*request == MIMPI_REQUEST_NULL || !(*request)->persistent ||
+		(*request)->active)
+		fatal("MIMPI_Start needs an inactive persistent request");
+
+	_MIMPI_Request_Restart(*request);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Startall(int count, MIMPI_Request *requests) {
+	for (int i = 0; i < count; i++)
+		MIMPI_Start(&requests[i]);
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request *request) {
+	if (*request == MIMPI_REQUEST_NULL || !(*request)->active)
+		return MIMPI_SUCCESS;
+
+	_MIMPI_Request_Progress(*request, true);
 
+	MIMPI_Retcode retcode = (*request)->retcode;
+
+	if ((*request)->persistent) {
+		(*request)->active = false;
+		return retcode;
+	}
+
+	free(*request);
+	*request = MIMPI_REQUEST_NULL;
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request *requests) {
 	MIMPI_Retcode retcode = MIMPI_SUCCESS;
-	retcode = _MIMPI_Collect(parent, children, NULL, NULL, 0, MIMPI_NOOP);
-	retcode = _MIMPI_Distribute(parent, children, data, count, retcode);
+
+	for (int i = 0; i < count; i++)
+		retcode = _MIMPI_Update_Retcode(retcode, MIMPI_Wait(&requests[i]));
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Test(MIMPI_Request *request, bool *flag) {
+	*flag = true;
+
+	if (*request == MIMPI_REQUEST_NULL || !(*request)->active)
+		return MIMPI_SUCCESS;
+
+	*flag = _MIMPI_Request_Progress(*request, false);
+
+	if (!*flag)
+		return MIMPI_SUCCESS;
+
+	return MIMPI_Wait(request);
+}
+
+MIMPI_Retcode MIMPI_Request_Free(MIMPI_Request *request) {
+	if (*request == MIMPI_REQUEST_NULL)
+		return MIMPI_SUCCESS;
+
+	MIMPI_Retcode retcode = MIMPI_Wait(request);
+
+	free(*request);
+	*request = MIMPI_REQUEST_NULL;
+
+	return retcode;
+}
+
+MIMPI_Comm MIMPI_Comm_World() {
+	return &MIMPI_world;
+}
+
+int MIMPI_Comm_Size(MIMPI_Comm comm) {
+	return comm->size;
+}
+
+int MIMPI_Comm_Rank(MIMPI_Comm comm) {
+	return comm->rank;
+}
+
+MIMPI_Retcode _MIMPI_Comm_Check_Peer(
+	struct MIMPI_Comm_Data const *comm,
+	int peer
+) {
+	if (peer == comm->rank)
+		return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+
+	if (peer < 0 || peer >= comm->size)
+		return MIMPI_ERROR_NO_SUCH_RANK;
+
+	return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Comm_Send(
+	void const *data,
+	int count,
+	int destination,
+	int tag,
+	MIMPI_Comm comm
+) {
+	MIMPI_Retcode retcode = _MIMPI_Comm_Check_Peer(comm, destination);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	long begin = _Profile_Begin();
+	retcode = _MIMPI_Send(data, count, comm->ranks[destination], tag,
+		comm->context);
+	_Profile_End(PROFILE_SEND, begin, count);
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Recv(
+	void *data,
+	int count,
+	int source,
+	int tag,
+	MIMPI_Comm comm
+) {
+	MIMPI_Retcode retcode = _MIMPI_Comm_Check_Peer(comm, source);
+
+	if (retcode != MIMPI_SUCCESS)
+		return retcode;
+
+	long begin = _Profile_Begin();
+	retcode = _MIMPI_Recv(data, count, comm->ranks[source], tag,
+		comm->context, MIMPI_deadlock_detection);
+	_Profile_End(PROFILE_RECV, begin, count);
+
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Barrier(MIMPI_Comm comm) {
+	long begin = _Profile_Begin();
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Barrier_Dissemination(comm, retcode);
+
+	_Profile_End(PROFILE_BARRIER, begin, 0);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Bcast(
+	void *data,
+	int count,
+	int root,
+	MIMPI_Comm comm
+) {
+	long begin = _Profile_Begin();
+	int parent, children[MIMPI_CHILDREN];
+	_MIMPI_Get_Neighbours(_Topology_For(count), &parent, children,
+		comm->rank, root, comm->size);
+
+	/* Ranks below one that never joins learn it from their parent's close. */
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Distribute(comm, parent, children, data, count,
+		retcode);
+
+	/* Our sends may have been buffered by children that are gone. */
+	for (int i = 0; i < MIMPI_CHILDREN; i++)
+		if (children[i] != -1)
+			retcode = _MIMPI_Update_Retcode(retcode,
+				_MIMPI_Collective_Await(comm, children[i]));
+
+	_Profile_End(PROFILE_BCAST, begin, count);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Reduce(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	int root,
+	MIMPI_Comm comm
+) {
+	_MIMPI_Check_Reduction(type, op);
+
+	long begin = _Profile_Begin();
+	int parent, children[MIMPI_CHILDREN];
+	_MIMPI_Get_Neighbours(_Topology_For(count * _MIMPI_Type_Size(type)),
+		&parent, children, comm->rank, root, comm->size);
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Update_Retcode(retcode, _MIMPI_Collect(comm, parent,
+		children, send_data, comm->rank == root ? recv_data : NULL, count,
+		type, op));
+
+	/* Partial results sent up may have been buffered by ranks that are gone. */
+	if (parent != -1) {
+		retcode = _MIMPI_Update_Retcode(retcode,
+			_MIMPI_Collective_Await(comm, parent));
+		retcode = _MIMPI_Update_Retcode(retcode,
+			_MIMPI_Collective_Await(comm, root));
+	}
+
+	_Profile_End(PROFILE_REDUCE, begin, count * _MIMPI_Type_Size(type));
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Allreduce(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	MIMPI_Comm comm
+) {
+	_MIMPI_Check_Reduction(type, op);
+
+	long begin = _Profile_Begin();
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+
+	size_t bytes = (size_t)count * _MIMPI_Type_Size(type);
+	if (bytes && recv_data != send_data) memcpy(recv_data, send_data, bytes);
+
+	if (comm->size > 1 && bytes >= MIMPI_ALLREDUCE_RING_THRESHOLD &&
+		count >= comm->size)
+		retcode = _MIMPI_Allreduce_Ring(comm, recv_data, count, type, op,
+			retcode);
+	else if (comm->size > 1)
+		retcode = _MIMPI_Allreduce_Doubling(comm, recv_data, count, type, op,
+			retcode);
+
+	_Profile_End(PROFILE_ALLREDUCE, begin, bytes);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Reduce_Scatter(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	MIMPI_Comm comm
+) {
+	_MIMPI_Check_Reduction(type, op);
+
+	long begin = _Profile_Begin();
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+
+	size_t bytes = (size_t)count * _MIMPI_Type_Size(type);
+
+	if (comm->size > 1)
+		retcode = _MIMPI_Reduce_Scatter_Ring(comm, send_data, recv_data,
+			count, type, op, retcode);
+	else if (bytes && recv_data != send_data)
+		memcpy(recv_data, send_data, bytes);
+
+	_Profile_End(PROFILE_REDUCE_SCATTER, begin, bytes);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Gather(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	int root,
+	MIMPI_Comm comm
+) {
+	long begin = _Profile_Begin();
+	int rank = comm->rank;
+	int size = comm->size;
+	int index = (rank - root + size) % size;
+	size_t span = (size_t)_MIMPI_Subtree(index, size) * count;
+
+	uint8_t *block = (uint8_t*)malloc(span + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(block);
+	if (count) memcpy(block, send_data, count);
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Gather(comm, block, count, root, retcode);
+
+	/* Blocks are ordered from root onwards, rotate them into rank order. */
+	if (rank == root && span) {
+		size_t tail = (size_t)(size - root) * count;
+		memcpy((uint8_t*)recv_data + root * (size_t)count, block, tail);
+		memcpy(recv_data, block + tail, span - tail);
+	}
+
+	free(block);
+
+	/* Blocks sent up may have been buffered by ranks that are gone. */
+	if (rank != root) {
+		int parent, children[MIMPI_CHILDREN];
+		_MIMPI_Get_Neighbours(&MIMPI_binomial_topology, &parent, children,
+			rank, root, size);
+
+		retcode = _MIMPI_Update_Retcode(retcode,
+			_MIMPI_Collective_Await(comm, parent));
+		retcode = _MIMPI_Update_Retcode(retcode,
+			_MIMPI_Collective_Await(comm, root));
+	}
+
+	_Profile_End(PROFILE_GATHER, begin, count);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Scatter(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	int root,
+	MIMPI_Comm comm
+) {
+	long begin = _Profile_Begin();
+	int rank = comm->rank;
+	int size = comm->size;
+	int index = (rank - root + size) % size;
+	size_t span = (size_t)_MIMPI_Subtree(index, size) * count;
+
+	uint8_t *block = (uint8_t*)malloc(span + sizeof(MIMPI_Retcode));
+	ASSERT_NOT_NULL(block);
+
+	if (rank == root && span) {
+		size_t tail = (size_t)(size - root) * count;
+		memcpy(block, (uint8_t const*)send_data + root * (size_t)count, tail);
+		memcpy(block + tail, send_data, span - tail);
+	}
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Scatter(comm, block, count, root, retcode);
+
+	if (count && (rank == root || retcode == MIMPI_SUCCESS))
+		memcpy(recv_data, block, count);
+
+	free(block);
+
+	/* Our sends may have been buffered by children that are gone. */
+	int parent, children[MIMPI_CHILDREN];
+	_MIMPI_Get_Neighbours(&MIMPI_binomial_topology, &parent, children, rank,
+		root, size);
+
+	for (int i = 0; i < MIMPI_CHILDREN; i++)
+		if (children[i] != -1)
+			retcode = _MIMPI_Update_Retcode(retcode,
+				_MIMPI_Collective_Await(comm, children[i]));
+
+	_Profile_End(PROFILE_SCATTER, begin, count);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Allgather(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Comm comm
+) {
+	uint8_t *data = (uint8_t*)recv_data + comm->rank * (size_t)count;
+	if (count) memmove(data, send_data, count);
+
+	long begin = _Profile_Begin();
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Allgather_Ring(comm, recv_data, count, retcode);
+
+	_Profile_End(PROFILE_ALLGATHER, begin, count);
+	return retcode;
+}
+
+MIMPI_Retcode MIMPI_Comm_Alltoall(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Comm comm
+) {
+	size_t own = comm->rank * (size_t)count;
+	if (count) memcpy((uint8_t*)recv_data + own,
+		(uint8_t const*)send_data + own, count);
+
+	long begin = _Profile_Begin();
+
+	MIMPI_Retcode retcode = _MIMPI_Collective_Begin(comm);
+	retcode = _MIMPI_Alltoall_Pairwise(comm, send_data, recv_data, count,
+		retcode);
+
+	_Profile_End(PROFILE_ALLTOALL, begin, count);
 	return retcode;
 }
 
+/*
+    Every rank learns the colors, keys and next free contexts of all others.
+    The new communicators take the largest next free context of their ranks,
+    so it is not used by any other communicator any of them is in, and
+    communicators of different colors are disjoint anyway.
+*/
+MIMPI_Retcode MIMPI_Comm_Split(
+	MIMPI_Comm comm,
+	int color,
+	int key,
+	MIMPI_Comm *result
+) {
+	*result = MIMPI_COMM_NULL;
+
+	int own[3] = { color, key, MIMPI_next_context };
+	int *all = (int*)malloc(comm->size * sizeof(own));
+	ASSERT_NOT_NULL(all);
+
+	MIMPI_Retcode retcode = MIMPI_Comm_Allgather(own, all, sizeof(own),
+		comm);
+
+	if (retcode != MIMPI_SUCCESS) {
+		free(all);
+		return retcode;
+	}
+
+	int context = MIMPI_next_context;
+	for (int i = 0; i < comm->size; i++)
+		if (all[3 * i + 2] > context) context = all[3 * i + 2];
+	MIMPI_next_context = context + 1;
+
+	if (color == MIMPI_UNDEFINED) {
+		free(all);
+		return MIMPI_SUCCESS;
+	}
+
+	struct MIMPI_Comm_Data *split =
+		(struct MIMPI_Comm_Data*)malloc(sizeof(struct MIMPI_Comm_Data));
+	ASSERT_NOT_NULL(split);
+	split->ranks = (int*)malloc(comm->size * sizeof(int));
+	ASSERT_NOT_NULL(split->ranks);
+	split->context = context;
+	split->size = 0;
+
+	/* Ranks of the color ordered by key, ties by rank in comm. */
+	int *members = (int*)malloc(comm->size * sizeof(int));
+	ASSERT_NOT_NULL(members);
+
+	for (int i = 0; i < comm->size; i++) {
+		if (all[3 * i] != color) continue;
+
+		int position = split->size++;
+		while (position > 0 &&
+			all[3 * members[position - 1] + 1] > all[3 * i + 1]) {
+			members[position] = members[position - 1];
+			position--;
+		}
+		members[position] = i;
+	}
+
+	for (int i = 0; i < split->size; i++) {
+		if (members[i] == comm->rank) split->rank = i;
+		split->ranks[i] = comm->ranks[members[i]];
+	}
+
+	free(members);
+	free(all);
+
+	*result = split;
+
+	return MIMPI_SUCCESS;
+}
+
+void MIMPI_Comm_Free(MIMPI_Comm *comm) {
+	if (*comm == MIMPI_COMM_NULL || *comm == &MIMPI_world)
+		return;
+
+	free((*comm)->ranks);
+	free(*comm);
+	*comm = MIMPI_COMM_NULL;
+}
+
+MIMPI_Retcode MIMPI_Barrier() {
+	return MIMPI_Comm_Barrier(&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Bcast(void *data, int count, int root) {
+	return MIMPI_Comm_Bcast(data, count, root, &MIMPI_world);
+}
+
 MIMPI_Retcode MIMPI_Reduce(
     void const *send_data,
     void *recv_data,
@@ -861,14 +5543,96 @@ MIMPI_Retcode MIMPI_Reduce(
     MIMPI_Op op,
     int root
 ) {
-	int parent, children[MIMPI_CHILDREN];
-	_MIMPI_Get_Neighbours(&parent, children, MIMPI_World_rank(), root,
-		MIMPI_World_size());
+	return MIMPI_Comm_Reduce(send_data, recv_data, count, MIMPI_UINT8, op,
+		root, &MIMPI_world);
+}
 
-	MIMPI_Retcode retcode = MIMPI_SUCCESS;
-	retcode = MIMPI_World_rank() == root ?
-		_MIMPI_Collect(parent, children, send_data, recv_data, count, op) :
-		_MIMPI_Collect(parent, children, send_data, NULL, count, op);
-	retcode = _MIMPI_Distribute(parent, children, NULL, 0, retcode);
-	return retcode;
+MIMPI_Retcode MIMPI_Reduce_Typed(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op,
+	int root
+) {
+	return MIMPI_Comm_Reduce(send_data, recv_data, count, type, op, root,
+		&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Allreduce(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Op op
+) {
+	return MIMPI_Comm_Allreduce(send_data, recv_data, count, MIMPI_UINT8,
+		op, &MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Allreduce_Typed(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op
+) {
+	return MIMPI_Comm_Allreduce(send_data, recv_data, count, type, op,
+		&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Reduce_Scatter(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	MIMPI_Datatype type,
+	MIMPI_Op op
+) {
+	return MIMPI_Comm_Reduce_Scatter(send_data, recv_data, count, type, op,
+		&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Gather(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	int root
+) {
+	return MIMPI_Comm_Gather(send_data, recv_data, count, root,
+		&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Scatter(
+	void const *send_data,
+	void *recv_data,
+	int count,
+	int root
+) {
+	return MIMPI_Comm_Scatter(send_data, recv_data, count, root,
+		&MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Allgather(
+	void const *send_data,
+	void *recv_data,
+	int count
+) {
+	return MIMPI_Comm_Allgather(send_data, recv_data, count, &MIMPI_world);
+}
+
+MIMPI_Retcode MIMPI_Alltoall(
+	void const *send_data,
+	void *recv_data,
+	int count
+) {
+	return MIMPI_Comm_Alltoall(send_data, recv_data, count, &MIMPI_world);
+}
+
+void MIMPI_Pool_Statistics(MIMPI_Pool_Stats *stats) {
+	memset(stats, 0, sizeof(MIMPI_Pool_Stats));
+
+	for (int rank = 0; rank < MIMPI_World_size(); rank++) {
+		if (rank == MIMPI_World_rank()) continue;
+
+		Inbox_Statistics(&MIMPI_inboxes[rank], stats);
+	}
 }
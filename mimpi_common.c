@@ -43,3 +43,106 @@ _Noreturn void fatal(const char* fmt, ...)
     fprintf(stderr, "\n");
     exit(1);
 }
+
+static size_t MIMPI_Page_Round(size_t size)
+{
+    return (size + MIMPI_SHM_PAGE - 1) / MIMPI_SHM_PAGE * MIMPI_SHM_PAGE;
+}
+
+size_t MIMPI_Shm_Size(int size)
+{
+    return MIMPI_Page_Round((size_t)size * sizeof(struct MIMPI_Rank_State));
+}
+
+struct MIMPI_Rank_State *MIMPI_Shm_State(void *shm, int rank)
+{
+    return (struct MIMPI_Rank_State*)shm + rank;
+}
+
+size_t MIMPI_Ring_Size(size_t capacity)
+{
+    return MIMPI_Page_Round(sizeof(struct MIMPI_Ring) + capacity);
+}
+
+socklen_t MIMPI_Channel_Address(
+    struct sockaddr_un *address,
+    int id,
+    int rank
+) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+
+    /* Leading zero byte puts the name in the abstract namespace. */
+    int length = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1,
+        "mimpi-%d-%d", id, rank);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+int MIMPI_Cpu_List(char const *list, int *cpus, int capacity)
+{
+    int count = 0;
+
+    while (*list && *list != '\n') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+
+        if (end == list || first < 0)
+            return -1;
+
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+
+        for (long cpu = first; cpu <= last && count < capacity; cpu++)
+            cpus[count++] = (int)cpu;
+
+        list = end;
+        if (*list == ',') list++;
+        else if (*list && *list != '\n') return -1;
+    }
+
+    return count;
+}
+
+int MIMPI_Cpu_Node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *directory = opendir(path);
+    if (!directory)
+        return 0;
+
+    int node = 0;
+    struct dirent *entry;
+
+    /* The CPU directory links to its node as "node<number>". */
+    while ((entry = readdir(directory)))
+        if (sscanf(entry->d_name, "node%d", &node) == 1)
+            break;
+
+    closedir(directory);
+
+    return node;
+}
+
+int MIMPI_Node_Cpus(int node, int *cpus, int capacity)
+{
+    char path[64], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+        node);
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+
+    char *read = fgets(list, sizeof(list), file);
+    fclose(file);
+
+    return read ? MIMPI_Cpu_List(list, cpus, capacity) : -1;
+}
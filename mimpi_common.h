@@ -7,9 +7,13 @@
 #define MIMPI_COMMON_H
 
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdnoreturn.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 /*
     Assert that expression doesn't evaluate to -1 (as almost every system function does in case of error).
@@ -45,11 +49,77 @@ _Noreturn extern void fatal(const char* fmt, ...);
 
 #define TODO fatal("UNIMPLEMENTED function %s", __PRETTY_FUNCTION__);
 
-#define MIMPI_SIZE 16
-
 #define MIMPI_CHANNEL_BASE 20
-#define MIMPI_CHANNEL_READER MIMPI_CHANNEL_BASE
-#define MIMPI_CHANNEL_WRITER (MIMPI_CHANNEL_BASE + MIMPI_SIZE)
+#define MIMPI_LISTEN_FD MIMPI_CHANNEL_BASE
+#define MIMPI_SHM_FD (MIMPI_CHANNEL_BASE + 1)
+
+#define MIMPI_SHM_RING_SIZE (256 * 1024)
+#define MIMPI_SHM_PAGE 4096
+
+/*
+    Single-producer single-consumer byte ring in memory shared by a pair of
+    ranks, created by the source when it first opens its channel to the
+    destination. Both counters only ever grow and are reduced modulo the
+    capacity (a power of two) on access.
+    The channel pipes are only used to wake up a reader waiting in an empty
+    ring; a writer waiting for space in a full ring sleeps on `space` futex.
+*/
+struct MIMPI_Ring {
+    _Alignas(64) _Atomic size_t head;
+    _Atomic int reader_waiting;
+    _Alignas(64) _Atomic size_t tail;
+    _Atomic int writer_waiting;
+    _Atomic unsigned int space;
+    _Alignas(64) char data[];
+};
+
+/*
+    Per-rank state visible to all ranks.
+    A rank bumps `collectives` on entering each collective and sets `finished`
+    in MIMPI_Finalize, so others can tell it will never join the current one.
+    Every such change bumps `changed` futex, woken when `waiters` is nonzero.
+*/
+struct MIMPI_Rank_State {
+    _Alignas(64) _Atomic unsigned long collectives;
+    _Atomic int finished;
+    _Atomic unsigned int changed;
+    _Atomic int waiters;
+};
+
+/* Size of shared memory holding states of all ranks. */
+extern size_t MIMPI_Shm_Size(int size);
+
+/* State of given rank inside shared memory. */
+extern struct MIMPI_Rank_State *MIMPI_Shm_State(void *shm, int rank);
+
+/* Size of shared memory holding a single ring of given capacity. */
+extern size_t MIMPI_Ring_Size(size_t capacity);
+
+/*
+    Abstract unix socket address on which given rank of the job identified
+    by `id` (pid of mimpirun) accepts channels from its peers. Connecting rank
+    sends its number along with the read end of a freshly created channel
+    (followed by its ring when shared memory is used), or without any
+    descriptor if it finished without ever using the channel.
+*/
+extern socklen_t MIMPI_Channel_Address(
+    struct sockaddr_un *address,
+    int id,
+    int rank
+);
+
+/*
+    Parses a list of CPUs or NUMA nodes in the kernel format, such as
+    "0-3,8,10-11", into at most `capacity` numbers. Returns how many were
+    read, or -1 if the list is malformed.
+*/
+extern int MIMPI_Cpu_List(char const *list, int *cpus, int capacity);
+
+/* NUMA node of given CPU, 0 when the machine does not report any. */
+extern int MIMPI_Cpu_Node(int cpu);
+
+/* CPUs of given NUMA node, returned as by MIMPI_Cpu_List. */
+extern int MIMPI_Node_Cpus(int node, int *cpus, int capacity);
 
 #define ASSERT_NOT_NULL(expr)                                                              \
     do {                                                                                   \
@@ -0,0 +1,412 @@
+/**
+ * This file is for declarations of MIMPI library extensions
+ * that go beyond the interface in mimpi.h.
+ * */
+
+#ifndef MIMPI_EXT_H
+#define MIMPI_EXT_H
+
+#include "mimpi.h"
+
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/*
+    Collectives and finished ranks: MIMPI_Bcast and MIMPI_Reduce pass data
+    through the tree in one direction only, so MIMPI_ERROR_REMOTE_FINISHED
+    is not reported by every rank when some rank finishes without joining.
+    In MIMPI_Bcast it is reported by the ranks below the missing one and by
+    its parent. In MIMPI_Reduce it is reported by the ranks above it, by its
+    children, and by every rank when the missing rank is the root.
+    MIMPI_Scatter behaves like MIMPI_Bcast and MIMPI_Gather like
+    MIMPI_Reduce. MIMPI_Barrier, MIMPI_Allreduce, MIMPI_Allgather and
+    MIMPI_Alltoall still report it on every rank.
+*/
+
+/*** Vectored communication ***/
+
+/*
+    Like MIMPI_Send, but sends the `count` buffers of `vector` back to back
+    as a single message, received as one contiguous buffer of their total
+    size. The buffers are not packed into an intermediate copy first.
+*/
+MIMPI_Retcode MIMPI_Sendv(
+    struct iovec const *vector,
+    int count,
+    int destination,
+    int tag
+);
+
+/*** Receiving from any source ***/
+
+#define MIMPI_ANY_SOURCE -1
+
+/* Where the message received with MIMPI_Recv_From came from. */
+typedef struct {
+    int source;
+    int tag;
+} MIMPI_Status;
+
+/*
+    Like MIMPI_Recv, but `source` may be MIMPI_ANY_SOURCE to take the first
+    matching message of any peer. Peers with messages waiting are taken in
+    turns. Unless `status` is NULL, the source and tag of the message are
+    stored there, source being MIMPI_ANY_SOURCE when every peer has
+    finished and MIMPI_ERROR_REMOTE_FINISHED is returned. Receives from any
+    source are not covered by deadlock detection.
+*/
+MIMPI_Retcode MIMPI_Recv_From(
+    void *data,
+    int count,
+    int source,
+    int tag,
+    MIMPI_Status *status
+);
+
+/*** Batching ***/
+
+/*
+    With MIMPI_BATCH_SIZE set, small messages sent with MIMPI_Send or
+    MIMPI_Sendv are gathered per destination and written out together.
+    Batches are written out whenever this rank waits for anything, so no
+    call is needed for progress. MIMPI_Flush writes out all batches now and
+    returns MIMPI_ERROR_REMOTE_FINISHED if some batch, written out here or
+    earlier, did not reach its destination.
+*/
+MIMPI_Retcode MIMPI_Flush();
+
+/*** Non-blocking communication ***/
+
+/* Handle of an operation started with MIMPI_Isend or MIMPI_Irecv. */
+typedef struct MIMPI_Request_Data *MIMPI_Request;
+
+#define MIMPI_REQUEST_NULL ((MIMPI_Request)0)
+
+/*
+    Starts sending `count` bytes of `data` to `destination`. The buffer must
+    not be modified until the request completes. Errors detectable up front
+    (bad rank, self operation) are returned immediately and leave `*request`
+    set to MIMPI_REQUEST_NULL.
+*/
+MIMPI_Retcode MIMPI_Isend(
+    void const *data,
+    int count,
+    int destination,
+    int tag,
+    MIMPI_Request *request
+);
+
+/*
+    Starts receiving a message of exactly `count` bytes from `source`.
+    Deadlock detection only covers blocking MIMPI_Recv calls.
+*/
+MIMPI_Retcode MIMPI_Irecv(
+    void *data,
+    int count,
+    int source,
+    int tag,
+    MIMPI_Request *request
+);
+
+/* Blocks until the request completes, releases it and returns its result. */
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request *request);
+
+/* Waits for all requests, returning the most severe of their results. */
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request *requests);
+
+/*
+    Sets `*flag` to whether the request has completed. A completed request
+    is released and its result returned, otherwise MIMPI_SUCCESS is returned.
+*/
+MIMPI_Retcode MIMPI_Test(MIMPI_Request *request, bool *flag);
+
+/*** Persistent communication ***/
+
+/*
+    Like MIMPI_Isend, but only sets the send up, message header included.
+    The request starts out inactive and each MIMPI_Start sends the current
+    contents of `data` again, writing them out right away as MIMPI_Send
+    would when nothing else is queued for the destination. MIMPI_Wait and
+    MIMPI_Test make the request inactive instead of releasing it, and
+    return MIMPI_SUCCESS right away for inactive ones.
+*/
+MIMPI_Retcode MIMPI_Send_Init(
+    void const *data,
+    int count,
+    int destination,
+    int tag,
+    MIMPI_Request *request
+);
+
+/* Like MIMPI_Send_Init, but sets up a receive as MIMPI_Irecv would. */
+MIMPI_Retcode MIMPI_Recv_Init(
+    void *data,
+    int count,
+    int source,
+    int tag,
+    MIMPI_Request *request
+);
+
+/* Starts an inactive persistent request, aborts the program otherwise. */
+MIMPI_Retcode MIMPI_Start(MIMPI_Request *request);
+
+MIMPI_Retcode MIMPI_Startall(int count, MIMPI_Request *requests);
+
+/*
+    Waits for the request if it is active, then releases it even if it is
+    persistent, returning its result.
+*/
+MIMPI_Retcode MIMPI_Request_Free(MIMPI_Request *request);
+
+/*** Typed reductions ***/
+
+typedef enum {
+    MIMPI_UINT8,
+    MIMPI_INT32,
+    MIMPI_INT64,
+    MIMPI_FLOAT,
+    MIMPI_DOUBLE,
+} MIMPI_Datatype;
+
+/*
+    Like MIMPI_Reduce, but reduces `count` elements of given type instead
+    of bytes. Integer sums and products wrap around on overflow. Values of
+    `type` or `op` outside their enums abort the program.
+
+    In every reduction `send_data` may equal `recv_data` of the rank that
+    gets a result, which then reduces in place.
+*/
+MIMPI_Retcode MIMPI_Reduce_Typed(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op,
+    int root
+);
+
+/*
+    Reduces `count` bytes from all ranks and leaves the result in
+    `recv_data` of every rank. Small messages use recursive doubling, large
+    ones a reduce-scatter followed by an allgather around the ring of ranks.
+*/
+MIMPI_Retcode MIMPI_Allreduce(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Op op
+);
+
+/* Like MIMPI_Allreduce, but for `count` elements of given type. */
+MIMPI_Retcode MIMPI_Allreduce_Typed(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op
+);
+
+/*
+    Reduces `count` elements of given type times the world size from all
+    ranks and leaves the i-th block of `count` elements of the result in
+    `recv_data` of rank i. Blocks go around the ring of ranks, each rank
+    sending and receiving one block per step. In place, `recv_data` holds
+    the input of all blocks and gets the result in its first one.
+*/
+MIMPI_Retcode MIMPI_Reduce_Scatter(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op
+);
+
+/*** Data movement ***/
+
+/*
+    Collects `count` bytes from every rank into `recv_data` of `root`,
+    ordered by rank, so it must hold `count` times the world size bytes.
+    `recv_data` is not touched on other ranks.
+*/
+MIMPI_Retcode MIMPI_Gather(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root
+);
+
+/*
+    Hands out consecutive blocks of `count` bytes of `send_data` of `root`,
+    the block of each rank ending up in its `recv_data`.
+*/
+MIMPI_Retcode MIMPI_Scatter(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root
+);
+
+/* Like MIMPI_Gather, but leaves the result in `recv_data` of every rank. */
+MIMPI_Retcode MIMPI_Allgather(
+    void const *send_data,
+    void *recv_data,
+    int count
+);
+
+/*
+    Sends the i-th block of `count` bytes of `send_data` to rank i, which
+    stores it as the block of the sender in its `recv_data`. Both buffers
+    hold `count` times the world size bytes and must not overlap.
+*/
+MIMPI_Retcode MIMPI_Alltoall(
+    void const *send_data,
+    void *recv_data,
+    int count
+);
+
+/*** Communicators ***/
+
+/*
+    Ordered subset of the ranks, numbered from zero in that order. Messages
+    and collectives of a communicator never match those of another one,
+    so collectives may run concurrently on communicators sharing no rank.
+    Every MIMPI function without a communicator works on the world.
+*/
+typedef struct MIMPI_Comm_Data *MIMPI_Comm;
+
+#define MIMPI_COMM_NULL ((MIMPI_Comm)0)
+#define MIMPI_UNDEFINED -1
+
+/* Communicator of all ranks, numbered as in MIMPI_World_rank. */
+MIMPI_Comm MIMPI_Comm_World();
+
+int MIMPI_Comm_Size(MIMPI_Comm comm);
+
+int MIMPI_Comm_Rank(MIMPI_Comm comm);
+
+/*
+    Collective over `comm` that puts the ranks passing the same `color`
+    into a new communicator, ordered by `key` and then by their rank in
+    `comm`. Ranks passing MIMPI_UNDEFINED get MIMPI_COMM_NULL.
+*/
+MIMPI_Retcode MIMPI_Comm_Split(
+    MIMPI_Comm comm,
+    int color,
+    int key,
+    MIMPI_Comm *result
+);
+
+/*
+    Releases a communicator made by MIMPI_Comm_Split and sets `*comm` to
+    MIMPI_COMM_NULL. The world is left alone.
+*/
+void MIMPI_Comm_Free(MIMPI_Comm *comm);
+
+/*
+    The functions below work like those without Comm in their name, with
+    ranks counted in `comm`. Reductions take the element type like the
+    _Typed ones. Ranks that finish without joining a collective of a
+    communicator other than the world are only reported by the ranks
+    waiting for their messages.
+*/
+
+MIMPI_Retcode MIMPI_Comm_Send(
+    void const *data,
+    int count,
+    int destination,
+    int tag,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Recv(
+    void *data,
+    int count,
+    int source,
+    int tag,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Barrier(MIMPI_Comm comm);
+
+MIMPI_Retcode MIMPI_Comm_Bcast(
+    void *data,
+    int count,
+    int root,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Reduce(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op,
+    int root,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Allreduce(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Reduce_Scatter(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Datatype type,
+    MIMPI_Op op,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Gather(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Scatter(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    int root,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Allgather(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Comm comm
+);
+
+MIMPI_Retcode MIMPI_Comm_Alltoall(
+    void const *send_data,
+    void *recv_data,
+    int count,
+    MIMPI_Comm comm
+);
+
+/*** Statistics ***/
+
+/*
+    Allocator counters of the inboxes, summed over all peers since
+    MIMPI_Init. A hit reuses a recycled message node or payload buffer,
+    a miss falls back to malloc.
+*/
+typedef struct {
+    unsigned long message_hits;
+    unsigned long message_misses;
+    unsigned long buffer_hits;
+    unsigned long buffer_misses;
+} MIMPI_Pool_Stats;
+
+void MIMPI_Pool_Statistics(MIMPI_Pool_Stats *stats);
+
+#endif // MIMPI_EXT_H
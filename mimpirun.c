@@ -2,6 +2,8 @@
  * This file is for implementation of mimpirun program.
  * */
 
+#define _GNU_SOURCE
+
 #include "mimpi_common.h"
 #include "channel.h"
 #include <stdio.h>
@@ -11,13 +13,15 @@
 #include <errno.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 
-#define CHANNEL_TABLE ((MIMPI_CHANNEL_BASE) + 3 * (MIMPI_SIZE))
-
-typedef enum {
-	READ,
-	WRITE
-} direction_t;
+/* Below the ephemeral ports Linux hands out to connecting sockets. */
+#define MIMPI_TCP_PORT_BASE 10000
+#define MIMPI_TCP_PORT_SPREAD 20000
 
 void move_fd(int old, int new) {
 	if (old == new) return;
@@ -26,72 +30,259 @@ void move_fd(int old, int new) {
 	ASSERT_SYS_OK(close(old));
 }
 
-void open_channel(int source, int destination) {
-	if (source == destination) return;
+/*
+    Channels between ranks are created lazily by the ranks themselves,
+    here every rank we start only gets a socket on which its peers on this
+    host hand them over.
+*/
+int *open_listeners(int first, int count) {
+	int *listeners = (int*)malloc((first + count) * sizeof(int));
+	ASSERT_NOT_NULL(listeners);
+
+	for (int rank = first; rank < first + count; rank++) {
+		struct sockaddr_un address;
+		socklen_t length = MIMPI_Channel_Address(&address, getpid(), rank);
+
+		listeners[rank] = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		ASSERT_SYS_OK(listeners[rank]);
+		ASSERT_SYS_OK(bind(listeners[rank], (struct sockaddr*)&address,
+			length));
+		ASSERT_SYS_OK(listen(listeners[rank], SOMAXCONN));
+	}
 
-	int fds[2];
-	ASSERT_SYS_OK(channel(fds));
+	return listeners;
+}
 
-	int index = CHANNEL_TABLE + MIMPI_SIZE * source + destination;
-	move_fd(fds[0], 2 * index);
-	move_fd(fds[1], 2 * index + 1);
+void close_listeners(int *listeners, int first, int count) {
+	for (int rank = first; rank < first + count; rank++)
+		ASSERT_SYS_OK(close(listeners[rank]));
+
+	free(listeners);
 }
 
-int get_channel(int source, int destination, direction_t direction) {
-	if (source == destination) return -1;
+size_t shm_capacity(void) {
+	char *transport = getenv("MIMPI_TRANSPORT");
+
+	if (transport && strcmp(transport, "pipe") == 0)
+		return 0;
+
+	size_t requested = MIMPI_SHM_RING_SIZE;
+	char *value = getenv("MIMPI_SHM_RING_SIZE");
+	if (value) requested = strtoull(value, NULL, 10);
 
-	int result = CHANNEL_TABLE + MIMPI_SIZE * source + destination;
-	result *= 2;
-	result += direction;
+	size_t capacity = MIMPI_SHM_PAGE;
+	while (capacity < requested) capacity *= 2;
 
-	return result;
+	return capacity;
 }
 
-void close_channel(int source, int destination) {
-	if (source == destination) return;
+void open_shm(int size) {
+	int fd = memfd_create("mimpi", 0);
+	ASSERT_SYS_OK(fd);
+	ASSERT_SYS_OK(ftruncate(fd, MIMPI_Shm_Size(size)));
+	move_fd(fd, MIMPI_SHM_FD);
+}
 
-	int index = CHANNEL_TABLE + MIMPI_SIZE * source + destination;
-	ASSERT_SYS_OK(close(2 * index));
-	ASSERT_SYS_OK(close(2 * index + 1));
+void close_shm(void) {
+	ASSERT_SYS_OK(close(MIMPI_SHM_FD));
 }
 
-void open_channels(int size) {
-	for (int source = 0; source < size; source++) {
-		for (int destination = 0; destination < size; destination++) {
-			open_channel(source, destination);
+/*
+    Sums the counters that ranks dumped under MIMPI_PROFILE into one more
+    file suffixed with "all", taking the largest value of "max" counters.
+*/
+void aggregate_profiles(char const *prefix, int size) {
+	size_t count = 0, capacity = 64;
+	char **names = (char**)malloc(capacity * sizeof(char*));
+	unsigned long *values = (unsigned long*)malloc(capacity *
+		sizeof(unsigned long));
+	ASSERT_NOT_NULL(names);
+	ASSERT_NOT_NULL(values);
+
+	for (int rank = 0; rank < size; rank++) {
+		char path[PATH_MAX], name[256];
+		unsigned long value;
+
+		snprintf(path, PATH_MAX, "%s.%d", prefix, rank);
+		FILE *file = fopen(path, "r");
+		if (!file) continue;
+
+		while (fscanf(file, "%255s %lu", name, &value) == 2) {
+			size_t i = 0;
+			while (i < count && strcmp(names[i], name) != 0) i++;
+
+			if (i == count) {
+				if (count == capacity) {
+					capacity *= 2;
+					names = (char**)realloc(names, capacity * sizeof(char*));
+					values = (unsigned long*)realloc(values, capacity *
+						sizeof(unsigned long));
+					ASSERT_NOT_NULL(names);
+					ASSERT_NOT_NULL(values);
+				}
+
+				names[count] = strdup(name);
+				ASSERT_NOT_NULL(names[count]);
+				values[count++] = 0;
+			}
+
+			size_t length = strlen(name);
+			bool max = length >= 4 && strcmp(name + length - 4, ".max") == 0;
+
+			if (!max) values[i] += value;
+			else if (value > values[i]) values[i] = value;
 		}
+
+		ASSERT_ZERO(fclose(file));
 	}
-}
 
-void prepare_channels(int rank, int size) {
-	for (int i = 0; i < size; i++) {
-		if (i == rank) continue;
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s.all", prefix);
+	FILE *file = fopen(path, "w");
+	if (!file) syserr("Cannot open profile %s", path);
 
-		ASSERT_SYS_OK(dup2(get_channel(i, rank, READ),
-			MIMPI_CHANNEL_READER + i));
+	for (size_t i = 0; i < count; i++) {
+		fprintf(file, "%s %lu\n", names[i], values[i]);
+		free(names[i]);
 	}
 
-	for (int i = 0; i < size; i++) {
-		if (i == rank) continue;
+	ASSERT_ZERO(fclose(file));
+	free(values);
+	free(names);
+}
 
-		ASSERT_SYS_OK(dup2(get_channel(rank, i, WRITE),
-			MIMPI_CHANNEL_WRITER + i));
+/*
+    Joins the timelines that ranks wrote under MIMPI_TRACE into one more
+    file suffixed with "json", so flows between ranks can be followed. Each
+    event of a rank's file is on its own line between the brackets.
+*/
+void merge_traces(char const *prefix, int size) {
+	char path[PATH_MAX];
+	snprintf(path, PATH_MAX, "%s.json", prefix);
+	FILE *merged = fopen(path, "w");
+	if (!merged) syserr("Cannot open trace %s", path);
+
+	char *line = NULL;
+	size_t capacity = 0;
+	bool first = true;
+
+	fprintf(merged, "[");
+
+	for (int rank = 0; rank < size; rank++) {
+		snprintf(path, PATH_MAX, "%s.%d.json", prefix, rank);
+		FILE *file = fopen(path, "r");
+		if (!file) continue;
+
+		ssize_t length;
+		while ((length = getline(&line, &capacity, file)) > 0) {
+			while (length > 0 && (line[length - 1] == '\n' ||
+				line[length - 1] == ','))
+				line[--length] = '\0';
+
+			if (line[0] != '{') continue;
+
+			fprintf(merged, "%s\n%s", first ? "" : ",", line);
+			first = false;
+		}
+
+		ASSERT_ZERO(fclose(file));
 	}
+
+	fprintf(merged, "\n]\n");
+	ASSERT_ZERO(fclose(merged));
+	free(line);
 }
 
-void close_channels(int size) {
-	for (int source = 0; source < size; source++) {
-		for (int destination = 0; destination < size; destination++) {
-			close_channel(source, destination);
+/*
+    CPUs of the ranks under MIMPI_BIND policy, or NULL when unset or "none".
+    "compact" fills NUMA nodes one after another, "scatter" deals ranks out
+    to nodes in turn, and a list of CPUs such as "0-3,8" is used in order.
+    Either way CPUs are reused from the start once every one is taken, and
+    counted from the first rank started on this host.
+*/
+int *bind_cpus(int size, int first) {
+	char *policy = getenv("MIMPI_BIND");
+	if (!policy || strcmp(policy, "none") == 0) return NULL;
+
+	int *order = (int*)malloc(CPU_SETSIZE * sizeof(int));
+	ASSERT_NOT_NULL(order);
+	int count = 0;
+
+	if (strcmp(policy, "compact") == 0 || strcmp(policy, "scatter") == 0) {
+		cpu_set_t allowed;
+		ASSERT_SYS_OK(sched_getaffinity(0, sizeof(cpu_set_t), &allowed));
+
+		int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE], available = 0;
+		int last_node = 0;
+
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &allowed)) continue;
+
+			cpus[available] = cpu;
+			nodes[available] = MIMPI_Cpu_Node(cpu);
+			if (nodes[available] > last_node) last_node = nodes[available];
+			available++;
 		}
+
+		bool scatter = policy[0] == 's';
+
+		/* Scatter takes the next CPU of each node per round, compact all. */
+		for (int round = 0; count < available; round++) {
+			for (int node = 0; node <= last_node; node++) {
+				int taken = 0;
+
+				for (int i = 0; i < available; i++) {
+					if (nodes[i] != node) continue;
+					if (scatter && taken++ != round) continue;
+					order[count++] = cpus[i];
+				}
+			}
+		}
+	} else {
+		count = MIMPI_Cpu_List(policy, order, CPU_SETSIZE);
 	}
+
+	if (count <= 0) fatal("Invalid MIMPI_BIND policy %s", policy);
+
+	int *placement = (int*)malloc(size * sizeof(int));
+	ASSERT_NOT_NULL(placement);
+
+	for (int rank = 0; rank < size; rank++)
+		placement[rank] = order[(rank - first + size) % size % count];
+
+	free(order);
+
+	return placement;
+}
+
+/* Hands the placement down to every rank, which binds its own threads. */
+void export_cpus(int const *cpus, int size) {
+	size_t length = 0, capacity = 16 * (size_t)size + 1;
+	char *list = (char*)malloc(capacity);
+	ASSERT_NOT_NULL(list);
+	list[0] = '\0';
+
+	for (int rank = 0; rank < size; rank++)
+		length += snprintf(list + length, capacity - length, "%s%d",
+			rank ? "," : "", cpus[rank]);
+
+	ASSERT_SYS_OK(setenv("MIMPI_CPUS", list, 1));
+	free(list);
 }
 
-void run_child(char *prog, char **args, int rank, int size) {
-	prepare_channels(rank, size);
-	close_channels(size);
+void run_child(char *prog, char **args, int rank, int size,
+	size_t capacity, int listener, int const *cpus) {
+	/* Listeners of other ranks are close-on-exec, only ours survives. */
+	move_fd(listener, MIMPI_LISTEN_FD);
+	ASSERT_SYS_OK(fcntl(MIMPI_LISTEN_FD, F_SETFD, 0));
+
+	char mimpi_rank[32], mimpi_size[32], mimpi_shm[64], mimpi_channel[32];
 
-	char mimpi_rank[32], mimpi_size[32];
+	snprintf(mimpi_channel, 32, "MIMPI_CHANNEL_ID=%d", getppid());
+	putenv(mimpi_channel);
+
+	snprintf(mimpi_shm, 64, "MIMPI_SHM_RING=%zu", capacity);
+	putenv(mimpi_shm);
 
 	snprintf(mimpi_rank, 32, "MIMPI_RANK=%d", rank);
 	putenv(mimpi_rank);
@@ -99,38 +290,246 @@ void run_child(char *prog, char **args, int rank, int size) {
 	snprintf(mimpi_size, 32, "MIMPI_SIZE=%d", size);
 	putenv(mimpi_size);
 
+	if (cpus) {
+		cpu_set_t cpu;
+		CPU_ZERO(&cpu);
+		CPU_SET(cpus[rank], &cpu);
+		ASSERT_SYS_OK(sched_setaffinity(0, sizeof(cpu_set_t), &cpu));
+	}
+
 	ASSERT_SYS_OK(execvp(prog, args));
 }
 
+/* Starts ranks from first on, of count, of a job of given size here. */
+void launch_local(int first, int count, int size, char **args) {
+	size_t capacity = shm_capacity();
+	int *cpus = bind_cpus(size, first);
+	if (cpus) export_cpus(cpus, size);
+
+	open_shm(size);
+	int *listeners = open_listeners(first, count);
+
+	for (int rank = first; rank < first + count; rank++) {
+		pid_t pid = fork();
+		ASSERT_SYS_OK(pid);
+
+		if (pid == 0) {
+			run_child(args[0], args, rank, size, capacity,
+				listeners[rank], cpus);
+		}
+	}
+
+	close_listeners(listeners, first, count);
+	close_shm();
+	free(cpus);
+
+	for (int rank = first + count - 1; rank >= first; rank--) {
+		wait(NULL);
+	}
+}
+
+void print_quoted(FILE *stream, char const *word) {
+	fputc('\'', stream);
+
+	for (; *word; word++) {
+		if (*word == '\'') fputs("'\\''", stream);
+		else fputc(*word, stream);
+	}
+
+	fputc('\'', stream);
+}
+
+struct Host {
+	char name[256];
+	int slots;
+	int count;
+};
+
+/* Hosts of a hostfile, each line being a host and optionally its slots. */
+struct Host *read_hostfile(char const *path, int *hosts) {
+	FILE *file = fopen(path, "r");
+	if (!file) syserr("Cannot open hostfile %s", path);
+
+	int capacity = 16;
+	struct Host *list = (struct Host*)malloc(capacity * sizeof(struct Host));
+	ASSERT_NOT_NULL(list);
+	*hosts = 0;
+
+	char *line = NULL;
+	size_t length = 0;
+
+	while (getline(&line, &length, file) > 0) {
+		char name[256];
+		int slots = 1;
+
+		char *comment = strchr(line, '#');
+		if (comment) *comment = '\0';
+
+		if (sscanf(line, "%255s slots=%d", name, &slots) < 1 &&
+			sscanf(line, "%255s %d", name, &slots) < 1)
+			continue;
+
+		if (slots < 1) fatal("Host %s in %s has no slots", name, path);
+
+		int host = 0;
+		while (host < *hosts && strcmp(list[host].name, name) != 0) host++;
+
+		if (host == *hosts) {
+			if (*hosts == capacity) {
+				capacity *= 2;
+				list = (struct Host*)realloc(list,
+					capacity * sizeof(struct Host));
+				ASSERT_NOT_NULL(list);
+			}
+
+			strcpy(list[host].name, name);
+			list[host].slots = 0;
+			list[host].count = 0;
+			(*hosts)++;
+		}
+
+		list[host].slots += slots;
+	}
+
+	free(line);
+	ASSERT_ZERO(fclose(file));
+
+	if (!*hosts) fatal("Hostfile %s names no hosts", path);
+
+	return list;
+}
+
+/*
+    Starts the ranks on the hosts of a hostfile. Ranks fill the slots of
+    hosts in order, those left over are dealt out to the hosts in turn.
+    Every host runs this program over MIMPI_RSH (ssh by default) for its
+    block of ranks, with all MIMPI settings forwarded. Ranks on different
+    hosts talk over TCP, on ports from MIMPI_TCP_PORT on.
+*/
+void launch_hosts(char const *hostfile, int size, char **args) {
+	int hosts;
+	struct Host *list = read_hostfile(hostfile, &hosts);
+
+	int placed = 0;
+	for (int host = 0; host < hosts && placed < size; host++) {
+		list[host].count = list[host].slots < size - placed ?
+			list[host].slots : size - placed;
+		placed += list[host].count;
+	}
+
+	for (int host = 0; placed < size; host = (host + 1) % hosts, placed++)
+		list[host].count++;
+
+	char *names;
+	size_t length;
+	FILE *stream = open_memstream(&names, &length);
+	ASSERT_NOT_NULL(stream);
+
+	for (int host = 0, rank = 0; host < hosts; host++)
+		for (int i = 0; i < list[host].count; i++, rank++)
+			fprintf(stream, "%s%s", rank ? "," : "", list[host].name);
+
+	ASSERT_ZERO(fclose(stream));
+	ASSERT_SYS_OK(setenv("MIMPI_HOSTS", names, 1));
+	free(names);
+
+	if (!getenv("MIMPI_TCP_PORT")) {
+		char port[16];
+		snprintf(port, sizeof(port), "%d", MIMPI_TCP_PORT_BASE +
+			getpid() % MIMPI_TCP_PORT_SPREAD);
+		ASSERT_SYS_OK(setenv("MIMPI_TCP_PORT", port, 1));
+	}
+
+	char self[PATH_MAX];
+	ssize_t self_length = readlink("/proc/self/exe", self, PATH_MAX - 1);
+	ASSERT_SYS_OK(self_length);
+	self[self_length] = '\0';
+
+	char *rsh = getenv("MIMPI_RSH");
+	if (!rsh) rsh = "ssh";
+
+	for (int host = 0, first = 0; host < hosts;
+		first += list[host].count, host++) {
+		if (!list[host].count) continue;
+
+		char *command;
+		stream = open_memstream(&command, &length);
+		ASSERT_NOT_NULL(stream);
+
+		fputs("env", stream);
+		for (char **variable = environ; *variable; variable++) {
+			if (strncmp(*variable, "MIMPI_", 6) != 0) continue;
+
+			fputc(' ', stream);
+			print_quoted(stream, *variable);
+		}
+
+		fprintf(stream, " MIMPI_NODE_RANKS=%d,%d ", first, list[host].count);
+		print_quoted(stream, self);
+		fprintf(stream, " %d", size);
+
+		for (char **arg = args; *arg; arg++) {
+			fputc(' ', stream);
+			print_quoted(stream, *arg);
+		}
+
+		ASSERT_ZERO(fclose(stream));
+
+		pid_t pid = fork();
+		ASSERT_SYS_OK(pid);
+
+		if (pid == 0)
+			ASSERT_SYS_OK(execlp(rsh, rsh, list[host].name, command, NULL));
+
+		free(command);
+	}
+
+	for (int host = 0; host < hosts; host++)
+		if (list[host].count) wait(NULL);
+
+	free(list);
+}
+
 int main(int argc, char **argv) {
+	char *hostfile = NULL;
+
+	if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+		hostfile = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
 	if (argc < 3) {
 		return 1;
 	}
 
-	size_t size = strtol(argv[1], NULL, 10);
+	int size = strtol(argv[1], NULL, 10);
 
-	if (size < 1 || size > MIMPI_SIZE) {
+	if (size < 1) {
 		return 1;
 	}
 
-	open_channels(size);
+	if (hostfile) {
+		launch_hosts(hostfile, size, &argv[2]);
+	} else {
+		/* Set when started by launch_hosts on one of the hosts. */
+		int first = 0, count = size;
+		char *node = getenv("MIMPI_NODE_RANKS");
 
-	pid_t pid[MIMPI_SIZE];
+		if (node && (sscanf(node, "%d,%d", &first, &count) != 2 ||
+			first < 0 || count < 1 || first + count > size))
+			fatal("Invalid MIMPI_NODE_RANKS=%s", node);
 
-	for (int rank = 0; rank < size; rank++) {
-		pid[rank] = fork();
-		ASSERT_SYS_OK(pid[rank]);
+		launch_local(first, count, size, &argv[2]);
 
-		if (pid[rank] == 0) {
-			run_child(argv[2], &argv[2], rank, size);
-		}
+		if (node) return 0;
 	}
 
-	close_channels(size);
+	char *profile = getenv("MIMPI_PROFILE");
+	if (profile) aggregate_profiles(profile, size);
 
-	for (int rank = size - 1; rank >= 0; rank--) {
-		wait(NULL);
-	}
+	char *trace = getenv("MIMPI_TRACE");
+	if (trace) merge_traces(trace, size);
 
 	return 0;
 }